@@ -0,0 +1,5 @@
+#export OMP_NUM_THREADS=16;./bin/ExaSP2-serial-CHEBYSHEV --hmatName data/poly_chain.512.mtx --N 6144 --M 260 --beta 2.6
+
+export OMP_NUM_THREADS=1;~/ExaSP2/bin/ExaSP2-serial-CHEBYSHEV --hmatName ~/ExaSP2/data/poly_chain.512.mtx --N 6144 --M 260 --beta 2.6 --chebDegree 0 --chebKernel 1 --dout 1
+
+#export OMP_NUM_THREADS=16;./bin/ExaSP2-serial-CHEBYSHEV --hmatName data/poly_chain.1024.mtx --N 12288 --M 1000 --beta 2.6 --eps 1e-6
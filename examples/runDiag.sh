@@ -0,0 +1,3 @@
+#export OMP_NUM_THREADS=16;./bin/ExaSP2-serial-DIAG --hmatName data/poly_chain.512.mtx --N 6144 --M 260 --diagMode 1 --dout 1
+
+export OMP_NUM_THREADS=1;~/ExaSP2/bin/ExaSP2-serial-DIAG --hmatName ~/ExaSP2/data/poly_chain.512.mtx --N 6144 --M 260 --refName dmatrix.out.mtx
@@ -0,0 +1,4 @@
+# Build with DECOMPOSITION = GRAPH (and METIS = ON if available) in the Makefile
+#export OMP_NUM_THREADS=16;./bin/ExaSP2-serial-BASIC --hmatName data/poly_chain.512.mtx --N 6144 --M 260 --nparts 64 --graphHops 2
+
+export OMP_NUM_THREADS=1;~/ExaSP2/bin/ExaSP2-serial-BASIC --hmatName ~/ExaSP2/data/poly_chain.512.mtx --N 6144 --M 260 --nparts 16 --graphHops 2
@@ -0,0 +1,3 @@
+#export OMP_NUM_THREADS=16;./bin/ExaSP2-serial-KERNEL --hmatName data/poly_chain.512.mtx --N 6144 --M 260 --hubbardU 1.0 --scfMethod 0
+
+export OMP_NUM_THREADS=1;~/ExaSP2/bin/ExaSP2-serial-KERNEL --hmatName ~/ExaSP2/data/poly_chain.512.mtx --N 6144 --M 260 --hubbardU 1.0 --kernelRank 4 --scfTol 1e-5
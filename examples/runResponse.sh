@@ -0,0 +1,3 @@
+#export OMP_NUM_THREADS=16;./bin/ExaSP2-serial-RESPONSE --hmatName data/poly_chain.512.mtx --N 6144 --M 260 --nresp 3
+
+export OMP_NUM_THREADS=1;~/ExaSP2/bin/ExaSP2-serial-RESPONSE --hmatName ~/ExaSP2/data/poly_chain.512.mtx --N 6144 --M 260 --nresp 3 --dout 1
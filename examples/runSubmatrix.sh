@@ -0,0 +1,3 @@
+#export OMP_NUM_THREADS=16;./bin/ExaSP2-serial-SUBMATRIX --hmatName data/poly_chain.512.mtx --N 6144 --M 260 --subBlock 64 --subHops 2
+
+export OMP_NUM_THREADS=1;~/ExaSP2/bin/ExaSP2-serial-SUBMATRIX --hmatName ~/ExaSP2/data/poly_chain.512.mtx --N 6144 --M 260 --subBlock 32 --subHops 1
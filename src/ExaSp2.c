@@ -45,9 +45,13 @@
 #include "bml.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <omp.h>
 
 #include "sp2Solver.h"
+#include "lanczos.h"
+#include "sp2Diag.h"
 #include "parallel.h"
 #include "performance.h"
 #include "mycommand.h"
@@ -119,6 +123,32 @@ int main(int argc,
   minsp2iter_i = cmd.minsp2iter;
   maxsp2iter_i = cmd.maxsp2iter;
   nsteps_i = cmd.nsteps;
+  muCands_i = cmd.muCands;
+  muOrder_i = cmd.muOrder;
+  occProbes_i = cmd.occProbes;
+  kpmMoments_i = cmd.kpmMoments;
+  lanczos_i = cmd.lanczos;
+  stopRule_i = cmd.stopRule;
+  purify_i = cmd.purify;
+  nsolves_i = cmd.nsolves;
+  replay_i = cmd.replay;
+  impMethod_i = cmd.impMethod;
+  cgGuess_i = cmd.cgGuess;
+  cgPrec_i = cmd.cgPrec;
+  cgMethod_i = cmd.cgMethod;
+  cgSchedule_i = cmd.cgSchedule;
+  chebDegree_i = cmd.chebDegree;
+  chebKernel_i = cmd.chebKernel;
+  nresp_i = cmd.nresp;
+  scfMethod_i = cmd.scfMethod;
+  kernelRank_i = cmd.kernelRank;
+  diagMode_i = cmd.diagMode;
+  subBlock_i = cmd.subBlock;
+  subHops_i = cmd.subHops;
+  subMethod_i = cmd.subMethod;
+  nparts_i = cmd.nparts;
+  graphHops_i = cmd.graphHops;
+  nslice_i = cmd.nslice;
   debug_i = cmd.debug;
   dout_i = cmd.dout;
 
@@ -131,17 +161,36 @@ int main(int argc,
   tscale_i = cmd.tscale;
   occLimit_i = cmd.occLimit;
   traceLimit_i = cmd.traceLimit;
+  dh_i = cmd.dh;
+  replayMargin_i = cmd.replayMargin;
+  cgTol_i = cmd.cgTol;
+  cgAcc_i = cmd.cgAcc;
+  hubbardU_i = cmd.hubbardU;
+  scfTol_i = cmd.scfTol;
+  spammTol_i = cmd.spammTol;
 
   if (bml_printRank())
   {
     printf("\nParameters:\n");
     printf("msparse = %d  N = %d\n", msparse_i, N_i);
-    printf("minsp2iter = %d  maxsp2iter = %d\n", minsp2iter_i, maxsp2iter_i);
-    printf("nsteps = %d  osteps = %d\n", nsteps_i, osteps_i);
+    printf("minsp2iter = %d  maxsp2iter = %d  stopRule = %d  purify = %d\n", minsp2iter_i, maxsp2iter_i, stopRule_i, purify_i);
+    printf("nsteps = %d  osteps = %d  muCands = %d  muOrder = %d\n", nsteps_i, osteps_i, muCands_i, muOrder_i);
     printf("mtype = %d  hmatName = %s\n", cmd.mtype, cmd.hmatName);
     printf("eps = %lg  tscale = %lg\n", eps_i, tscale_i);
     printf("idemTol = %lg  bndfil = %lg  beta = %lg  mu = %lg\n", idemTol_i, bndfil_i, beta_i, mu_i);
     printf("occLimit = %lg  traceLimit = %lg\n", occLimit_i, traceLimit_i);
+    printf("occProbes = %d  kpmMoments = %d  lanczos = %d\n", occProbes_i, kpmMoments_i, lanczos_i);
+    printf("nsolves = %d  dh = %lg  replay = %d  replayMargin = %lg\n", nsolves_i, dh_i, replay_i, replayMargin_i);
+    printf("impMethod = %d  cgGuess = %d  cgPrec = %d  cgMethod = %d\n", impMethod_i, cgGuess_i, cgPrec_i, cgMethod_i);
+    printf("cgTol = %lg  cgSchedule = %d  cgAcc = %lg\n", cgTol_i, cgSchedule_i, cgAcc_i);
+    printf("chebDegree = %d  chebKernel = %d\n", chebDegree_i, chebKernel_i);
+    printf("nresp = %d  pertName = %s\n", nresp_i, cmd.pertName);
+    printf("scfMethod = %d  kernelRank = %d  hubbardU = %lg  scfTol = %lg\n", 
+      scfMethod_i, kernelRank_i, hubbardU_i, scfTol_i);
+    printf("spammTol = %lg  nslice = %d\n", spammTol_i, nslice_i);
+    printf("diagMode = %d  refName = %s\n", diagMode_i, cmd.refName);
+    printf("subBlock = %d  subHops = %d  subMethod = %d\n", subBlock_i, subHops_i, subMethod_i);
+    printf("nparts = %d  graphHops = %d\n", nparts_i, graphHops_i);
     printf("debug = %d  dout = %d\n\n", debug_i, dout_i);
   }
 
@@ -161,45 +210,235 @@ int main(int argc,
   }
   printf("nocc = %lg\n", nocc_i);
 
+#if defined(SP2_IMP) || defined(SP2_FERMI)
+  // Pick the recursion depth if not given
+  if (nsteps_i <= 0)
+  {
 #ifdef SP2_IMP
-  printf("Calling Implicit Fermi\n"); 
-  implicit_recursiveLoops(h_bml, rho_bml, beta_i, mu_i, nsteps_i, eps_i);
+    nsteps_i = recursionDepth(h_bml, nocc_i, beta_i, mu_i, occLimit_i, 
+      cgTol_i, eps_i);
+    if (bml_printRank()) 
+      printf("nsteps = %d (automatic, beta = %lg  occLimit = %lg)\n", 
+        nsteps_i, beta_i, occLimit_i);
+#else
+    nsteps_i = recursionDepth(h_bml, nocc_i, beta_i, tscale_i, eps_i);
+    if (bml_printRank()) 
+      printf("nsteps = %d (automatic from beta = %lg only, the mu search "
+        "meets occLimit)\n", nsteps_i, beta_i);
+#endif
+  }
+#endif
+
+#ifdef SP2_CHEBYSHEV
+  // Pick the polynomial degree if not given
+  if (chebDegree_i <= 0)
+  {
+    chebDegree_i = chebyshevDegree(h_bml, nocc_i, beta_i, eps_i);
+    if (bml_printRank()) 
+      printf("chebDegree = %d (automatic, beta = %lg)\n", chebDegree_i, beta_i);
+  }
+  real_t mu = ZERO;
 #endif
 
 #ifdef SP2_BASIC
-  printf("Calling Basic\n");
-  // Perform SP2 loop
-  sp2Loop(h_bml, rho_bml, nocc_i, minsp2iter_i, maxsp2iter_i, idemTol_i, eps_i);
+  // Branch sequence recorded for replay
+  Sp2Sequence seq;
+  seq.nsteps = 0;
+  seq.branch = bml_allocate_memory(maxsp2iter_i*sizeof(int));
+#endif
+#if defined(SP2_BASIC) && !defined(SP2_KERNEL) && !defined(SP2_GRAPH)
+  int record = (replay_i == 1);
+#endif
+
+#if defined(SP2_RESPONSE) && defined(DECOMP_GRAPH)
+  if (bml_printRank()) 
+    printf("RESPONSE needs the recorded SP2 sequence, ignoring the GRAPH decomposition\n");
+#endif
+
+#ifdef SP2_GRAPH
+  if (purify_i != 0 || replay_i != 0 || spammTol_i > ZERO || nslice_i > 0)
+  {
+    if (bml_printRank()) 
+      printf("GRAPH uses its own SP2 loop, ignoring purify, replay, spammTol and nslice\n");
+    purify_i = 0;
+    replay_i = 0;
+    spammTol_i = ZERO;
+    nslice_i = 0;
+  }
+
+  // The pattern of H is the same for all solves, partition it once
+  startTimer(partitionTimer);
+  GraphPartition* gpart = graphPartition(h_bml, nparts_i, graphHops_i, eps_i);
+  stopTimer(partitionTimer);
+#endif
+
+#ifdef SP2_DIAG
+  // Diagonalize or purify, decided once for all solves
+  int useDiag = diagSelect(h_bml, diagMode_i, eps_i);
+#endif
+
+#if defined(SP2_RESPONSE) && !defined(SP2_KERNEL)
+  // The response pass follows the recorded SP2 sequence
+  record = 1;
+  if (purify_i != 0)
+  {
+    if (bml_printRank()) printf("RESPONSE uses the SP2 loop, ignoring purify\n");
+    purify_i = 0;
+  }
+  bml_matrix_t** pert_bml = responsePerturbations(h_bml, nresp_i, cmd.pertName);
+  bml_matrix_t** resp_bml = malloc(nresp_i * sizeof(bml_matrix_t*));
+  for (int k = 0; k < nresp_i; k++)
+    resp_bml[k] = bml_zero_matrix(matrix_type, precision, N_i, M_i, dmode);
 #endif
 
 #ifdef SP2_FERMI
-  printf("Calling Fermi\n");
   real_t mu = ZERO;
   real_t beta = beta_i;
   int* sgnlist = bml_allocate_memory(nsteps_i*sizeof(int));
   real_t h1 = ZERO;
   real_t hN = ZERO;
   real_t kbt = ZERO;
+#endif
 
-  // Perform truncated SP2 Fermi initialization followed by Fermi
-  printf("sp2Init start: mu = %lg beta = %lg \n", mu, beta);
-  startTimer(sp2InitTimer);
-  sp2Init(h_bml, rho_bml, nsteps_i, nocc_i, &mu, &beta, sgnlist, &h1, &hN,
-    tscale_i, occLimit_i, traceLimit_i, eps_i); 
-  stopTimer(sp2InitTimer);
+  // Repeated solves on a slowly changing H, as in an MD run
+  int nreplay = 0;
+  for (int solve = 0; solve < nsolves_i; solve++)
+  {
+    if (solve > 0)
+    {
+      real_t scale = ONE + dh_i;
+      bml_scale_inplace(&scale, h_bml);
+      if (bml_printRank()) printf("\nSolve %d\n", solve);
+    }
 
-  kbt = ABS(ONE / beta);
-  printf("sp2Init complete: mu = %lg beta = %lg kbt = %lg\n", mu, beta, kbt);
+#ifdef SP2_IMP
+    printf("Calling Implicit Fermi\n"); 
+    if (implicit_recursiveLoops(h_bml, rho_bml, beta_i, mu_i, nsteps_i, 
+          impMethod_i, cgGuess_i, cgPrec_i, cgMethod_i, cgTol_i, cgSchedule_i, 
+          cgAcc_i, eps_i) > 0)
+      printf("Warning: density matrix from non-converged CG solves\n");
+#endif
 
-  startTimer(sp2LoopTimer);
-  sp2Loop(h_bml, rho_bml, nsteps_i, nocc_i, &mu, beta, sgnlist, h1, hN,
-    osteps_i, eps_i, traceLimit_i, eps_i);
-  stopTimer(sp2LoopTimer);
+#if defined(SP2_BASIC) && !defined(SP2_KERNEL)
+#ifdef SP2_DIAG
+    if (useDiag)
+    {
+      printf("Calling Diag\n");
+      diagLoop(h_bml, rho_bml, nocc_i, beta_i, eps_i);
+    }
+    else
+#endif
+    {
+#ifdef SP2_GRAPH
+      printf("Calling Graph\n");
+      graphSp2Loop(h_bml, rho_bml, nocc_i, gpart, minsp2iter_i, maxsp2iter_i,
+        idemTol_i, eps_i);
+#else
+      printf("Calling Basic\n");
+      // Perform SP2 loop, or a higher order purification. With replay the
+      // recorded sequence is tried first and the adaptive loop (which
+      // records a new one) is the fallback.
+      if (purify_i == 1)
+        trs4Loop(h_bml, rho_bml, nocc_i, maxsp2iter_i, idemTol_i, eps_i);
+      else if (purify_i == 2)
+        canonicalLoop(h_bml, rho_bml, nocc_i, maxsp2iter_i, idemTol_i, eps_i);
+      else if (replay_i == 1 && seq.nsteps > 0 && 
+               sp2Replay(h_bml, rho_bml, nocc_i, &seq, idemTol_i, eps_i))
+        nreplay++;
+      else
+        sp2Loop(h_bml, rho_bml, nocc_i, minsp2iter_i, maxsp2iter_i, idemTol_i, 
+          eps_i, (record) ? &seq : NULL);
+#endif
+    }
+#endif
 
-  printf("sp2Loop complete: mu = %lg beta = %lg kbt = %lg\n", mu, beta, kbt);
+#if defined(SP2_RESPONSE) && !defined(SP2_KERNEL)
+    printf("Calling Response\n");
+    responseLoop(h_bml, pert_bml, resp_bml, nresp_i, &seq, 1, eps_i);
+#endif
 
-  bml_free_memory(sgnlist);
+#ifdef SP2_KERNEL
+    printf("Calling Kernel SCF\n");
+    kernelScf(h_bml, rho_bml, nocc_i, scfMethod_i, kernelRank_i, hubbardU_i,
+      scfTol_i, &seq, eps_i);
+#endif
+
+#ifdef SP2_FERMI
+    printf("Calling Fermi\n");
+
+    // With replay, sgnlist, h1 and hN are kept from the last solve and mu
+    // is the warm start, as long as [h1,hN] still holds the spectrum
+    int initNeeded = 1;
+    if (replay_i == 1 && solve > 0)
+    {
+      real_t* bnd = spectralBounds(h_bml, nocc_i, eps_i);
+      initNeeded = (bnd[0] < h1 || bnd[1] > hN);
+      bml_free_memory(bnd);
+    }
+
+    if (initNeeded)
+    {
+      // Perform truncated SP2 Fermi initialization followed by Fermi
+      beta = beta_i;
+      printf("sp2Init start: mu = %lg beta = %lg \n", mu, beta);
+      startTimer(sp2InitTimer);
+      sp2Init(h_bml, rho_bml, nsteps_i, nocc_i, &mu, &beta, sgnlist, &h1, &hN,
+        tscale_i, occLimit_i, traceLimit_i, eps_i); 
+      stopTimer(sp2InitTimer);
+
+      kbt = ABS(ONE / beta);
+      printf("sp2Init complete: mu = %lg beta = %lg kbt = %lg\n", mu, beta, kbt);
+    }
+    else
+    {
+      nreplay++;
+      printf("sp2Init skipped: replaying sgnlist from mu = %lg\n", mu);
+    }
+
+    startTimer(sp2LoopTimer);
+    sp2Loop(h_bml, rho_bml, nsteps_i, nocc_i, &mu, beta, sgnlist, h1, hN,
+      osteps_i, eps_i, traceLimit_i, eps_i);
+    stopTimer(sp2LoopTimer);
+
+    printf("sp2Loop complete: mu = %lg beta = %lg kbt = %lg\n", mu, beta, kbt);
+#endif
+
+#ifdef SP2_CHEBYSHEV
+    printf("Calling Chebyshev\n");
+
+    startTimer(sp2LoopTimer);
+    chebyshevLoop(h_bml, rho_bml, nocc_i, &mu, beta_i, chebDegree_i, 
+      chebKernel_i, eps_i);
+    stopTimer(sp2LoopTimer);
+
+    printf("chebyshevLoop complete: mu = %lg beta = %lg\n", mu, beta_i);
+#endif
+
+#ifdef SP2_SUBMATRIX
+    printf("Calling Submatrix\n");
+
+    // Purification keeps mu, diagonalization sets it
+    real_t mu = mu_i;
+    startTimer(sp2LoopTimer);
+    submatrixLoop(h_bml, rho_bml, nocc_i, &mu, subBlock_i, subHops_i, subMethod_i,
+      maxsp2iter_i, idemTol_i, eps_i);
+    stopTimer(sp2LoopTimer);
+#endif
+  }
 
+  if (bml_printRank() && replay_i == 1)
+    printf("Replayed %d of %d solves\n", nreplay, nsolves_i);
+
+#ifdef SP2_BASIC
+  bml_free_memory(seq.branch);
+#endif
+
+#ifdef SP2_GRAPH
+  destroyGraphPartition(&gpart);
+#endif
+
+#ifdef SP2_FERMI
+  bml_free_memory(sgnlist);
 #endif
   // Done
   profileStop(totalTimer);
@@ -214,6 +453,25 @@ int main(int argc,
     bml_write_bml_matrix(rho_bml, "dmatrix.out.mtx");
   }
 
+  // Accuracy against a reference, e.g. a DIAG run with --dout 1
+  if (strlen(cmd.refName) > 0)
+    diagReference(rho_bml, cmd.refName);
+
+#if defined(SP2_RESPONSE) && !defined(SP2_KERNEL)
+  // Write out response matrices
+  if (bml_printRank() && dout_i == 1)
+  {
+    char fileName[64];
+    for (int k = 0; k < nresp_i; k++)
+    {
+      sprintf(fileName, "response.%d.out.mtx", k);
+      bml_write_bml_matrix(resp_bml[k], fileName);
+    }
+  }
+  destroyMatrices(&pert_bml, nresp_i);
+  destroyMatrices(&resp_bml, nresp_i);
+#endif
+
   /// Deallocate matrices, etc.
   bml_deallocate(&h_bml);
   bml_deallocate(&rho_bml);
@@ -33,6 +33,32 @@ int minsp2iter_i;
 int maxsp2iter_i;
 int nsteps_i;
 int osteps_i;
+int muCands_i;
+int muOrder_i;
+int occProbes_i;
+int kpmMoments_i;
+int lanczos_i;
+int stopRule_i;
+int purify_i;
+int nsolves_i;
+int replay_i;
+int impMethod_i;
+int cgGuess_i;
+int cgPrec_i;
+int cgMethod_i;
+int cgSchedule_i;
+int chebDegree_i;
+int chebKernel_i;
+int nresp_i;
+int scfMethod_i;
+int kernelRank_i;
+int diagMode_i;
+int subBlock_i;
+int subHops_i;
+int subMethod_i;
+int nparts_i;
+int graphHops_i;
+int nslice_i;
 int debug_i;
 int dout_i;
 
@@ -45,6 +71,13 @@ real_t beta_i;
 real_t tscale_i;
 real_t occLimit_i;
 real_t traceLimit_i;
+real_t dh_i;
+real_t replayMargin_i;
+real_t cgTol_i;
+real_t cgAcc_i;
+real_t hubbardU_i;
+real_t scfTol_i;
+real_t spammTol_i;
 #else
 extern int msparse_i;
 extern int N_i;
@@ -54,6 +87,32 @@ extern int minsp2iter_i;
 extern int maxsp2iter_i;
 extern int nsteps_i;
 extern int osteps_i;
+extern int muCands_i;
+extern int muOrder_i;
+extern int occProbes_i;
+extern int kpmMoments_i;
+extern int lanczos_i;
+extern int stopRule_i;
+extern int purify_i;
+extern int nsolves_i;
+extern int replay_i;
+extern int impMethod_i;
+extern int cgGuess_i;
+extern int cgPrec_i;
+extern int cgMethod_i;
+extern int cgSchedule_i;
+extern int chebDegree_i;
+extern int chebKernel_i;
+extern int nresp_i;
+extern int scfMethod_i;
+extern int kernelRank_i;
+extern int diagMode_i;
+extern int subBlock_i;
+extern int subHops_i;
+extern int subMethod_i;
+extern int nparts_i;
+extern int graphHops_i;
+extern int nslice_i;
 extern int debug_i;
 extern int dout_i;
 
@@ -66,6 +125,13 @@ extern real_t beta_i;
 extern real_t tscale_i;
 extern real_t occLimit_i;
 extern real_t traceLimit_i;
+extern real_t dh_i;
+extern real_t replayMargin_i;
+extern real_t cgTol_i;
+extern real_t cgAcc_i;
+extern real_t hubbardU_i;
+extern real_t scfTol_i;
+extern real_t spammTol_i;
 #endif
 
 #endif
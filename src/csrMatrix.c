@@ -0,0 +1,184 @@
+/// \file
+/// Compressed sparse row matrix for matrix-vector products.
+///
+/// BML has no matrix-vector product, so algorithms working on vectors
+/// (stochastic traces, Lanczos) take a CSR copy of the matrix once
+/// and apply it with csrMatVec. The same copy gives the graph of the
+/// matrix for the local solvers (SUBMATRIX, GRAPH), see
+/// csrNeighborhood and csrSubmatrix.
+
+#include "bml.h"
+
+#include "csrMatrix.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "constants.h"
+
+/// \details
+/// Build a CSR copy of a BML matrix, dropping entries with magnitude
+/// at or below threshold. Rows are read one at a time as dense rows
+/// (BML exposes no sparse row access), so a conversion costs O(N^2)
+/// whatever the sparsity of the matrix. Convert once per solve and
+/// reuse the copy.
+CsrMatrix* csrFromBml(const bml_matrix_t* a_bml,
+                      const real_t threshold)
+{
+  int N = bml_get_N(a_bml);
+
+  CsrMatrix* a = malloc(sizeof(CsrMatrix));
+  a->N = N;
+  a->rowPtr = malloc((N + 1) * sizeof(int));
+
+  int capacity = N;
+  int* colIndex = malloc(capacity * sizeof(int));
+  real_t* value = malloc(capacity * sizeof(real_t));
+
+  int nnz = 0;
+  for (int i = 0; i < N; i++)
+  {
+    a->rowPtr[i] = nnz;
+    real_t* row = bml_get_row((bml_matrix_t*) a_bml, i);
+
+    for (int j = 0; j < N; j++)
+    {
+      if (ABS(row[j]) <= threshold) continue;
+
+      if (nnz == capacity)
+      {
+        capacity *= 2;
+        colIndex = realloc(colIndex, capacity * sizeof(int));
+        value = realloc(value, capacity * sizeof(real_t));
+      }
+      colIndex[nnz] = j;
+      value[nnz] = row[j];
+      nnz++;
+    }
+    bml_free_memory(row);
+  }
+  a->rowPtr[N] = nnz;
+
+  a->nnz = nnz;
+  a->colIndex = colIndex;
+  a->value = value;
+
+  return a;
+}
+
+/// \details
+/// y = A*x
+void csrMatVec(const CsrMatrix* a,
+               const real_t* x,
+               real_t* y)
+{
+  #pragma omp parallel for
+  for (int i = 0; i < a->N; i++)
+  {
+    real_t sum = ZERO;
+    for (int k = a->rowPtr[i]; k < a->rowPtr[i+1]; k++)
+      sum += a->value[k] * x[a->colIndex[k]];
+    y[i] = sum;
+  }
+}
+
+/// \details
+/// Dot product of two vectors of length n.
+real_t csrDot(const int n,
+              const real_t* x,
+              const real_t* y)
+{
+  real_t sum = ZERO;
+
+  #pragma omp parallel for reduction(+:sum)
+  for (int i = 0; i < n; i++)
+    sum += x[i] * y[i];
+
+  return sum;
+}
+
+/// \details
+/// Grow a set of ncore core rows by hops steps along the non-zeroes of
+/// A. On return list holds the core rows followed by the new ones in
+/// breadth first order, and their number is returned. local (N long)
+/// must be all -1 on entry and is again on return; list is N long
+/// and may hold the core on entry (core == list).
+int csrNeighborhood(const CsrMatrix* a,
+                    const int* core,
+                    const int ncore,
+                    const int hops,
+                    int* local,
+                    int* list)
+{
+  int n = 0;
+  for (int p = 0; p < ncore; p++)
+  {
+    local[core[p]] = n;
+    list[n++] = core[p];
+  }
+
+  // One layer per hop
+  int start = 0;
+  for (int hop = 0; hop < hops; hop++)
+  {
+    int end = n;
+    for (int p = start; p < end; p++)
+    {
+      int row = list[p];
+      for (int k = a->rowPtr[row]; k < a->rowPtr[row+1]; k++)
+      {
+        int j = a->colIndex[k];
+        if (local[j] < 0)
+        {
+          local[j] = n;
+          list[n++] = j;
+        }
+      }
+    }
+    start = end;
+  }
+
+  for (int p = 0; p < n; p++)
+    local[list[p]] = -1;
+
+  return n;
+}
+
+/// \details
+/// Dense principal submatrix of A on the n rows in index, written row
+/// major into sub (n*n long). local is as in csrNeighborhood.
+void csrSubmatrix(const CsrMatrix* a,
+                  const int* index,
+                  const int n,
+                  int* local,
+                  real_t* sub)
+{
+  for (int p = 0; p < n; p++)
+    local[index[p]] = p;
+
+  for (int p = 0; p < n; p++)
+  {
+    real_t* row = sub + (size_t) p * n;
+    for (int q = 0; q < n; q++)
+      row[q] = ZERO;
+    for (int k = a->rowPtr[index[p]]; k < a->rowPtr[index[p]+1]; k++)
+    {
+      int q = local[a->colIndex[k]];
+      if (q >= 0) row[q] = a->value[k];
+    }
+  }
+
+  for (int p = 0; p < n; p++)
+    local[index[p]] = -1;
+}
+
+/// \details
+/// Deallocate a CSR matrix.
+void csrDestroy(CsrMatrix** a)
+{
+  free((*a)->colIndex);
+  free((*a)->value);
+  free((*a)->rowPtr);
+  free(*a);
+  *a = NULL;
+}
@@ -0,0 +1,47 @@
+/// \file
+/// Compressed sparse row matrix for matrix-vector products.
+
+#ifndef __CSRMATRIX_H
+#define __CSRMATRIX_H
+
+#include "bml.h"
+
+#include "mytype.h"
+
+/// Compressed sparse row copy of a square matrix.
+typedef struct CsrMatrixSt
+{
+  int N;              //!< number of rows (and columns)
+  int nnz;            //!< number of stored non-zeroes
+  int* rowPtr;        //!< start of each row in colIndex/value, N+1 long
+  int* colIndex;      //!< column of each non-zero
+  real_t* value;      //!< value of each non-zero
+} CsrMatrix;
+
+CsrMatrix* csrFromBml(const bml_matrix_t* a_bml,
+                      const real_t threshold);
+
+void csrMatVec(const CsrMatrix* a,
+               const real_t* x,
+               real_t* y);
+
+real_t csrDot(const int n,
+              const real_t* x,
+              const real_t* y);
+
+int csrNeighborhood(const CsrMatrix* a,
+                    const int* core,
+                    const int ncore,
+                    const int hops,
+                    int* local,
+                    int* list);
+
+void csrSubmatrix(const CsrMatrix* a,
+                  const int* index,
+                  const int n,
+                  int* local,
+                  real_t* sub);
+
+void csrDestroy(CsrMatrix** a);
+
+#endif
@@ -0,0 +1,269 @@
+/// \file
+/// Graph partitioning of the rows of a matrix.
+///
+/// The graph has a vertex per row and an edge per non-zero above the
+/// threshold. It is split into parts of about equal size with METIS
+/// (built with METIS = ON), or otherwise by greedy graph growing, which
+/// keeps parts connected and compact for chain and slab like systems
+/// but does not refine the cut as METIS does. Each part is then grown by
+/// hops steps along the edges; the added rows are its halo.
+
+#ifdef DECOMP_GRAPH
+
+#include "bml.h"
+
+#include "graphPartition.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "parallel.h"
+#include "constants.h"
+#include "csrMatrix.h"
+
+#ifdef DO_METIS
+// metis.h has its own real_t
+#define real_t metis_real_t
+#include <metis.h>
+#undef real_t
+#endif
+
+/// \details
+/// Fallback partitioner by greedy graph growing. Each part is grown
+/// breadth first over unassigned rows until it has its share of N,
+/// starting next to the last row of the previous part, so the parts
+/// sweep through the graph. The first seed is the last row reached
+/// from row 0, which is far out on chains and slabs.
+static void growPartition(const CsrMatrix* g,
+                          const int nparts,
+                          int* part)
+{
+  int N = g->N;
+  // Rows can be queued once per incoming edge
+  int* queue = malloc((g->nnz + N) * sizeof(int));
+
+  for (int i = 0; i < N; i++)
+    part[i] = -1;
+
+  // Seed from a first sweep
+  int seed = 0;
+  int head = 0;
+  int tail = 0;
+  queue[tail++] = 0;
+  part[0] = 0;
+  while (head < tail)
+  {
+    seed = queue[head++];
+    for (int k = g->rowPtr[seed]; k < g->rowPtr[seed+1]; k++)
+      if (part[g->colIndex[k]] < 0)
+      {
+        part[g->colIndex[k]] = 0;
+        queue[tail++] = g->colIndex[k];
+      }
+  }
+  for (int k = 0; k < tail; k++)
+    part[queue[k]] = -1;
+
+  int assigned = 0;
+  int next = 0;
+  for (int p = 0; p < nparts; p++)
+  {
+    int target = (int) ((long) (p + 1) * N / nparts);
+    int last = seed;
+    head = 0;
+    tail = 0;
+    queue[tail++] = seed;
+    while (assigned < target)
+    {
+      if (head == tail)
+      {
+        // Part not connected, continue from any unassigned row
+        while (part[next] >= 0) next++;
+        queue[tail++] = next;
+      }
+      int v = queue[head++];
+      if (part[v] >= 0) continue;
+      part[v] = p;
+      assigned++;
+      last = v;
+      for (int k = g->rowPtr[v]; k < g->rowPtr[v+1]; k++)
+        if (part[g->colIndex[k]] < 0) queue[tail++] = g->colIndex[k];
+    }
+
+    // Next seed: unassigned neighbor of the latest rows of this part
+    seed = -1;
+    for (int k = g->rowPtr[last]; k < g->rowPtr[last+1] && seed < 0; k++)
+      if (part[g->colIndex[k]] < 0) seed = g->colIndex[k];
+    for (int q = tail - 1; q >= head && seed < 0; q--)
+      if (part[queue[q]] < 0) seed = queue[q];
+    if (seed < 0 && assigned < N)
+    {
+      while (part[next] >= 0) next++;
+      seed = next;
+    }
+  }
+
+  free(queue);
+}
+
+#ifdef DO_METIS
+/// \details
+/// Partition with METIS_PartGraphKway. The graph passed to METIS has
+/// no self loops. Returns 0 if METIS fails.
+static int metisPartition(const CsrMatrix* g,
+                          const int nparts,
+                          int* part)
+{
+  idx_t nvtxs = g->N;
+  idx_t ncon = 1;
+  idx_t np = nparts;
+  idx_t objval;
+  idx_t* xadj = malloc((g->N + 1) * sizeof(idx_t));
+  idx_t* adjncy = malloc(MAX(g->nnz, 1) * sizeof(idx_t));
+  idx_t* mpart = malloc(g->N * sizeof(idx_t));
+
+  idx_t nadj = 0;
+  for (int i = 0; i < g->N; i++)
+  {
+    xadj[i] = nadj;
+    for (int k = g->rowPtr[i]; k < g->rowPtr[i+1]; k++)
+      if (g->colIndex[k] != i) adjncy[nadj++] = g->colIndex[k];
+  }
+  xadj[g->N] = nadj;
+
+  idx_t options[METIS_NOPTIONS];
+  METIS_SetDefaultOptions(options);
+  options[METIS_OPTION_NUMBERING] = 0;
+
+  int status = METIS_OK;
+  if (nparts > 1)
+    status = METIS_PartGraphKway(&nvtxs, &ncon, xadj, adjncy, NULL, NULL,
+      NULL, &np, NULL, NULL, options, &objval, mpart);
+  else
+    for (int i = 0; i < g->N; i++) mpart[i] = 0;
+
+  for (int i = 0; i < g->N; i++)
+    part[i] = (int) mpart[i];
+
+  free(xadj);
+  free(adjncy);
+  free(mpart);
+
+  return (status == METIS_OK);
+}
+#endif
+
+/// \details
+/// Split the rows of g_bml into nparts parts (at most N), each with
+/// a halo of hops layers, and report the partition quality.
+GraphPartition* graphPartition(const bml_matrix_t* g_bml,
+                               const int nparts,
+                               const int hops,
+                               const real_t threshold)
+{
+  int N = bml_get_N(g_bml);
+  CsrMatrix* g = csrFromBml(g_bml, threshold);
+
+  GraphPartition* gp = malloc(sizeof(GraphPartition));
+  gp->nparts = MAX(MIN(nparts, N), 1);
+  gp->part = malloc(N * sizeof(int));
+
+  char* method = "greedy";
+#ifdef DO_METIS
+  if (metisPartition(g, gp->nparts, gp->part))
+    method = "METIS";
+  else
+#endif
+  growPartition(g, gp->nparts, gp->part);
+
+  // Rows grouped by part
+  gp->coreStart = calloc(gp->nparts + 1, sizeof(int));
+  for (int i = 0; i < N; i++)
+    gp->coreStart[gp->part[i] + 1]++;
+  for (int p = 0; p < gp->nparts; p++)
+    gp->coreStart[p+1] += gp->coreStart[p];
+  gp->core = malloc(N * sizeof(int));
+  int* fill = malloc(gp->nparts * sizeof(int));
+  for (int p = 0; p < gp->nparts; p++)
+    fill[p] = gp->coreStart[p];
+  for (int i = 0; i < N; i++)
+    gp->core[fill[gp->part[i]]++] = i;
+  free(fill);
+
+  int nedges = 0;
+  gp->edgeCut = 0;
+  for (int i = 0; i < N; i++)
+    for (int k = g->rowPtr[i]; k < g->rowPtr[i+1]; k++)
+    {
+      if (g->colIndex[k] <= i) continue;
+      nedges++;
+      if (gp->part[g->colIndex[k]] != gp->part[i]) gp->edgeCut++;
+    }
+
+  // Halos
+  gp->size = malloc(gp->nparts * sizeof(int));
+  gp->index = malloc(gp->nparts * sizeof(int*));
+  #pragma omp parallel
+  {
+    int* local = malloc(N * sizeof(int));
+    int* list = malloc(N * sizeof(int));
+    for (int i = 0; i < N; i++)
+      local[i] = -1;
+
+    #pragma omp for schedule(dynamic)
+    for (int p = 0; p < gp->nparts; p++)
+    {
+      int ncore = gp->coreStart[p+1] - gp->coreStart[p];
+      int n = csrNeighborhood(g, gp->core + gp->coreStart[p], ncore, hops,
+        local, list);
+      gp->size[p] = n;
+      gp->index[p] = malloc(n * sizeof(int));
+      for (int q = 0; q < n; q++)
+        gp->index[p][q] = list[q];
+    }
+
+    free(local);
+    free(list);
+  }
+
+  if (bml_printRank())
+  {
+    int coreMin = N, coreMax = 0, haloMin = N, haloMax = 0;
+    real_t haloSum = ZERO;
+    for (int p = 0; p < gp->nparts; p++)
+    {
+      int ncore = gp->coreStart[p+1] - gp->coreStart[p];
+      int nhalo = gp->size[p] - ncore;
+      coreMin = MIN(coreMin, ncore);
+      coreMax = MAX(coreMax, ncore);
+      haloMin = MIN(haloMin, nhalo);
+      haloMax = MAX(haloMax, nhalo);
+      haloSum += nhalo;
+    }
+    printf("Graph partition (%s): %d parts, edge cut %d of %d\n", method,
+      gp->nparts, gp->edgeCut, nedges);
+    printf("  core min %d max %d, halo min %d avg %lg max %d (%d hops)\n",
+      coreMin, coreMax, haloMin, haloSum / gp->nparts, haloMax, hops);
+  }
+
+  csrDestroy(&g);
+
+  return gp;
+}
+
+/// \details
+/// Deallocate a graph partition.
+void destroyGraphPartition(GraphPartition** gp)
+{
+  for (int p = 0; p < (*gp)->nparts; p++)
+    free((*gp)->index[p]);
+  free((*gp)->index);
+  free((*gp)->size);
+  free((*gp)->core);
+  free((*gp)->coreStart);
+  free((*gp)->part);
+  free(*gp);
+  *gp = NULL;
+}
+
+#endif
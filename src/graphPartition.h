@@ -0,0 +1,30 @@
+/// \file
+/// Graph partitioning of the rows of a matrix.
+
+#ifndef __GRAPHPARTITION_H
+#define __GRAPHPARTITION_H
+
+#include "bml.h"
+
+#include "mytype.h"
+
+/// Rows of a matrix split into parts, each with a halo of neighbors.
+typedef struct GraphPartitionSt
+{
+  int nparts;          //!< number of parts
+  int* part;           //!< part of each row, N long
+  int* coreStart;      //!< start of each part in core, nparts+1 long
+  int* core;           //!< rows of all parts, grouped by part
+  int* size;           //!< core plus halo size of each part
+  int** index;         //!< core rows then halo rows of each part
+  int edgeCut;         //!< edges of the graph between parts
+} GraphPartition;
+
+GraphPartition* graphPartition(const bml_matrix_t* g_bml,
+                               const int nparts,
+                               const int hops,
+                               const real_t threshold);
+
+void destroyGraphPartition(GraphPartition** gp);
+
+#endif
@@ -0,0 +1,352 @@
+/// \file
+/// Lanczos estimates of spectral bounds.
+///
+/// Gershgorin bounds can overestimate the spectral range of H by a
+/// wide margin, and every doubling of the range costs the SP2 solvers
+/// about two iterations. A few steps of Lanczos on a random start
+/// vector give extreme Ritz values that converge quickly to the ends
+/// of the spectrum. They are widened by the last off-diagonal element
+/// beta_k, an upper bound on every Ritz residual norm, and by
+/// LANCZOS_MARGIN of the Ritz range, then intersected with the
+/// Gershgorin interval. This is a heuristic, not an enclosure: a Ritz
+/// value only has some eigenvalue within its residual norm, and after
+/// few steps the extreme eigenvalues can lie further out.
+///
+/// At least LANCZOS_MIN_STEPS steps are run: a single step gives just
+/// the Rayleigh quotient, which on the polyethylene chain cut the
+/// spectrum in half and broke the SP2 solve.
+///
+/// The narrower range has not been seen to pay off: on a gapped chain
+/// BASIC with the error stopping rule took 17 iterations with either
+/// bounds, so Gershgorin stays the default.
+///
+/// Because the bounds may miss part of the spectrum, spectralBounds
+/// checks them against Tr(X0) and Tr(X0^2) of the normalized
+/// X0 = (emax - H) / (emax - emin), both known from Tr(H) and
+/// ||H||_F without forming X0. With all eigenvalues of X0 in [0,1],
+/// Tr(X0 - X0^2) >= 0. When this fails the Gershgorin bounds are used.
+/// The check is necessary, not sufficient: on the gapped chain it
+/// passed bounds that cut a quarter off each end. SP2 catches those
+/// later, when the stray eigenvalues grow and Tr(X^2) exceeds Tr(X),
+/// and asks for Gershgorin bounds through rejectLanczosBounds.
+///
+/// The same run also gives a Gauss quadrature of the density of states
+/// (Ritz values weighted by the squared first components of the Ritz
+/// vectors), used to place nocc states and estimate the HOMO-LUMO gap.
+/// This stays meaningful without reorthogonalization, so only three
+/// vectors are kept.
+
+#include "bml.h"
+
+#include "lanczos.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "parallel.h"
+#include "constants.h"
+#include "csrMatrix.h"
+#include "stochasticTrace.h"
+
+/// Widening of the Lanczos bounds as a fraction of the Ritz range
+#define LANCZOS_MARGIN 0.01
+
+/// Fewest Lanczos steps run for the bounds
+#define LANCZOS_MIN_STEPS 5
+
+/// Bounds last returned by spectralBounds with lanczos_i > 0, and the
+/// H they belong to
+static const bml_matrix_t* cacheH = NULL;
+static real_t cacheTrace = ZERO;
+static real_t cacheNorm = ZERO;
+static real_t cacheBnd[2];
+static real_t cacheGbnd[2];
+static int cacheLanczos = 0;
+
+/// \details
+/// Eigenvalues and eigenvectors of a symmetric tridiagonal matrix by
+/// the implicit QL method. On entry d holds the diagonal and e[0..n-2]
+/// the off-diagonal; on return d holds the eigenvalues and column k of
+/// z (z[i*n+k]) the eigenvector of d[k]. e is destroyed.
+void tridiagonalEigen(const int n,
+                      real_t* d,
+                      real_t* e,
+                      real_t* z)
+{
+  for (int i = 0; i < n; i++)
+    for (int k = 0; k < n; k++)
+      z[i*n+k] = (i == k) ? ONE : ZERO;
+  e[n-1] = ZERO;
+
+  for (int l = 0; l < n; l++)
+  {
+    int iter = 0;
+    int m;
+    do
+    {
+      for (m = l; m < n - 1; m++)
+      {
+        real_t dd = ABS(d[m]) + ABS(d[m+1]);
+        if (ABS(e[m]) <= 1.0E-15 * dd) break;
+      }
+      if (m == l || iter++ == 60) break;
+
+      real_t g = (d[l+1] - d[l]) / (TWO * e[l]);
+      real_t r = hypot(g, ONE);
+      g = d[m] - d[l] + e[l] / (g + copysign(r, g));
+      real_t s = ONE;
+      real_t c = ONE;
+      real_t p = ZERO;
+      int i;
+      for (i = m - 1; i >= l; i--)
+      {
+        real_t f = s * e[i];
+        real_t b = c * e[i];
+        r = hypot(f, g);
+        e[i+1] = r;
+        if (r == ZERO)
+        {
+          d[i+1] -= p;
+          e[m] = ZERO;
+          break;
+        }
+        s = f / r;
+        c = g / r;
+        g = d[i+1] - p;
+        r = (d[i] - g) * s + TWO * c * b;
+        p = s * r;
+        d[i+1] = g + p;
+        g = c * r - b;
+
+        for (int k = 0; k < n; k++)
+        {
+          f = z[k*n+i+1];
+          z[k*n+i+1] = s * z[k*n+i] + c * f;
+          z[k*n+i] = c * z[k*n+i] - s * f;
+        }
+      }
+      if (r == ZERO && i >= l) continue;
+      d[l] -= p;
+      e[l] = g;
+      e[m] = ZERO;
+    } while (m != l);
+  }
+}
+
+/// \details
+/// Spectral bounds of h_bml from nsteps Lanczos steps, returned as a
+/// two element array {emin, emax} to be freed with bml_free_memory,
+/// like bml_gershgorin. If 0 < nocc < N, *gap is set to the estimated
+/// HOMO-LUMO gap, otherwise to zero.
+real_t* lanczosBounds(const bml_matrix_t* h_bml,
+                      const int nsteps,
+                      const real_t nocc,
+                      real_t* gap,
+                      const real_t threshold)
+{
+  int N = bml_get_N(h_bml);
+  int k = MIN(MAX(nsteps, LANCZOS_MIN_STEPS), N);
+
+  CsrMatrix* h = csrFromBml(h_bml, threshold);
+
+  real_t* v = malloc(N * sizeof(real_t));
+  real_t* vOld = calloc(N, sizeof(real_t));
+  real_t* w = malloc(N * sizeof(real_t));
+  real_t* alpha = malloc(k * sizeof(real_t));
+  real_t* beta = malloc(k * sizeof(real_t));
+
+  randomProbe(N, 0, v);
+  real_t vnorm = sqrt((real_t) N);
+  for (int i = 0; i < N; i++) v[i] /= vnorm;
+
+  // Tridiagonal T = tridiag(beta, alpha, beta)
+  int nt = 0;
+  real_t betaLast = ZERO;
+  for (int j = 0; j < k; j++)
+  {
+    csrMatVec(h, v, w);
+
+    real_t a = ZERO;
+    for (int i = 0; i < N; i++)
+    {
+      w[i] -= betaLast * vOld[i];
+      a += w[i] * v[i];
+    }
+
+    real_t b = ZERO;
+    for (int i = 0; i < N; i++)
+    {
+      w[i] -= a * v[i];
+      b += w[i] * w[i];
+    }
+    b = sqrt(b);
+
+    alpha[j] = a;
+    beta[j] = b;
+    betaLast = b;
+    nt++;
+
+    // Invariant subspace found, Ritz values are exact
+    if (b <= 1.0E-12 * ABS(a)) break;
+
+    for (int i = 0; i < N; i++)
+    {
+      vOld[i] = v[i];
+      v[i] = w[i] / b;
+    }
+  }
+
+  real_t* z = malloc(nt * nt * sizeof(real_t));
+  tridiagonalEigen(nt, alpha, beta, z);
+
+  // Extreme Ritz values widened by beta_k and the margin
+  int jmin = 0;
+  int jmax = 0;
+  for (int j = 1; j < nt; j++)
+  {
+    if (alpha[j] < alpha[jmin]) jmin = j;
+    if (alpha[j] > alpha[jmax]) jmax = j;
+  }
+
+  real_t* gbnd = bml_gershgorin(h_bml);
+  real_t* bnd = bml_allocate_memory(2 * sizeof(real_t));
+  real_t widen = betaLast + LANCZOS_MARGIN * (alpha[jmax] - alpha[jmin]);
+  bnd[0] = alpha[jmin] - widen;
+  bnd[1] = alpha[jmax] + widen;
+  bnd[0] = MAX(bnd[0], gbnd[0]);
+  bnd[1] = MIN(bnd[1], gbnd[1]);
+  bml_free_memory(gbnd);
+
+  // Gap from the quadrature: Ritz values in increasing order, each
+  // carrying N*z(0,j)^2 states. HOMO is the node where the count of
+  // states reaches nocc, LUMO the next one.
+  *gap = ZERO;
+  if (nocc > ZERO && nocc < N)
+  {
+    int* order = malloc(nt * sizeof(int));
+    for (int j = 0; j < nt; j++)
+    {
+      int pos = j;
+      while (pos > 0 && alpha[order[pos-1]] > alpha[j])
+      {
+        order[pos] = order[pos-1];
+        pos--;
+      }
+      order[pos] = j;
+    }
+
+    real_t count = ZERO;
+    for (int j = 0; j < nt - 1; j++)
+    {
+      count += N * z[order[j]] * z[order[j]];
+      if (count >= nocc - HALF)
+      {
+        *gap = alpha[order[j+1]] - alpha[order[j]];
+        break;
+      }
+    }
+    free(order);
+  }
+
+  free(v);
+  free(vOld);
+  free(w);
+  free(alpha);
+  free(beta);
+  free(z);
+  csrDestroy(&h);
+
+  return bnd;
+}
+
+/// \details
+/// Spectral bounds used to normalize H, returned as {emin, emax} and
+/// freed with bml_free_memory. These are the Gershgorin bounds, or with
+/// lanczos_i > 0 the Lanczos bounds from lanczos_i steps, in which
+/// case both are reported with the estimated gap. Lanczos bounds that
+/// fail the Tr(X0 - X0^2) >= 0 check are replaced by Gershgorin.
+///
+/// The Lanczos bounds are computed once per H and reused by later
+/// calls. H is recognized by its address, trace and Frobenius norm,
+/// so a Hamiltonian updated in place is bounded again.
+real_t* spectralBounds(const bml_matrix_t* h_bml,
+                       const real_t nocc,
+                       const real_t threshold)
+{
+  if (lanczos_i <= 0)
+    return bml_gershgorin(h_bml);
+
+  real_t trace = bml_trace(h_bml);
+  real_t norm = bml_fnorm((bml_matrix_t*) h_bml);
+  if (h_bml == cacheH && trace == cacheTrace && norm == cacheNorm)
+  {
+    real_t* bnd = bml_allocate_memory(2 * sizeof(real_t));
+    bnd[0] = cacheBnd[0];
+    bnd[1] = cacheBnd[1];
+    return bnd;
+  }
+
+  real_t gap;
+  real_t* bnd = lanczosBounds(h_bml, lanczos_i, nocc, &gap, threshold);
+  real_t* gbnd = bml_gershgorin(h_bml);
+
+  // Traces of the normalized X0, from Tr(H) and Tr(H^2) = ||H||_F^2
+  int N = bml_get_N(h_bml);
+  real_t width = bnd[1] - bnd[0];
+  real_t trX0 = (N * bnd[1] - trace) / width;
+  real_t trX02 = (N * bnd[1] * bnd[1] - TWO * bnd[1] * trace + norm * norm) /
+    (width * width);
+  int fallback = (trX02 - trX0 > 1.0E-10 * N);
+  if (fallback)
+  {
+    bnd[0] = gbnd[0];
+    bnd[1] = gbnd[1];
+  }
+
+  cacheH = h_bml;
+  cacheTrace = trace;
+  cacheNorm = norm;
+  cacheBnd[0] = bnd[0];
+  cacheBnd[1] = bnd[1];
+  cacheGbnd[0] = gbnd[0];
+  cacheGbnd[1] = gbnd[1];
+  cacheLanczos = !fallback;
+
+  if (bml_printRank())
+  {
+    if (fallback)
+      printf("Lanczos bounds give Tr(X0 - X0^2) = %lg < 0, "
+        "using Gershgorin %lg %lg\n", trX0 - trX02, gbnd[0], gbnd[1]);
+    else
+      printf("Lanczos bounds: emin = %lg emax = %lg (Gershgorin %lg %lg)\n",
+        bnd[0], bnd[1], gbnd[0], gbnd[1]);
+
+    if (gap > ZERO)
+      printf("Estimated HOMO-LUMO gap = %lg\n", gap);
+  }
+  bml_free_memory(gbnd);
+
+  return bnd;
+}
+
+/// \details
+/// Replace the Lanczos bounds last returned by spectralBounds with the
+/// Gershgorin bounds of the same H, for a solver that found its
+/// spectrum outside them. Returns 1 if Lanczos bounds were replaced, so
+/// the solve can be restarted, and 0 if they were Gershgorin already.
+int rejectLanczosBounds(void)
+{
+  if (lanczos_i <= 0 || cacheLanczos == 0)
+    return 0;
+
+  cacheBnd[0] = cacheGbnd[0];
+  cacheBnd[1] = cacheGbnd[1];
+  cacheLanczos = 0;
+
+  if (bml_printRank())
+    printf("Spectrum outside the Lanczos bounds, using Gershgorin %lg %lg\n",
+      cacheBnd[0], cacheBnd[1]);
+
+  return 1;
+}
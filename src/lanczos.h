@@ -0,0 +1,28 @@
+/// \file
+/// Lanczos estimates of spectral bounds.
+
+#ifndef __LANCZOS_H
+#define __LANCZOS_H
+
+#include "bml.h"
+
+#include "mytype.h"
+
+void tridiagonalEigen(const int n,
+                      real_t* d,
+                      real_t* e,
+                      real_t* z);
+
+real_t* lanczosBounds(const bml_matrix_t* h_bml,
+                      const int nsteps,
+                      const real_t nocc,
+                      real_t* gap,
+                      const real_t threshold);
+
+real_t* spectralBounds(const bml_matrix_t* h_bml,
+                       const real_t nocc,
+                       const real_t threshold);
+
+int rejectLanczosBounds(void);
+
+#endif
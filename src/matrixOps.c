@@ -0,0 +1,33 @@
+/// \file
+/// Matrix operations composed from BML calls.
+
+#include "bml.h"
+
+#include "matrixOps.h"
+
+#include "constants.h"
+
+/// \details
+/// Anticommutator of two symmetric matrices.
+///
+/// C = A*B + B*A
+///
+/// For symmetric A and B, B*A = (A*B)^T, so only one product is formed
+/// and the second term is its transpose. t_bml is scratch space of the
+/// same shape as C.
+void anticommutator(const bml_matrix_t* a_bml,
+                    const bml_matrix_t* b_bml,
+                    bml_matrix_t* c_bml,
+                    bml_matrix_t* t_bml,
+                    const real_t threshold)
+{
+  // C = A*B
+  bml_multiply(a_bml, b_bml, c_bml, ONE, ZERO, threshold);
+
+  // T = (A*B)^T = B*A
+  bml_copy(c_bml, t_bml);
+  bml_transpose(t_bml);
+
+  // C = A*B + B*A
+  bml_add(c_bml, t_bml, ONE, ONE, threshold);
+}
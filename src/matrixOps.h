@@ -0,0 +1,17 @@
+/// \file
+/// Matrix operations composed from BML calls.
+
+#ifndef __MATRIXOPS_H
+#define __MATRIXOPS_H
+
+#include "bml.h"
+
+#include "mytype.h"
+
+void anticommutator(const bml_matrix_t* a_bml,
+                    const bml_matrix_t* b_bml,
+                    bml_matrix_t* c_bml,
+                    bml_matrix_t* t_bml,
+                    const real_t threshold);
+
+#endif
@@ -22,7 +22,7 @@
 static int myRank = 0;
 static int nRanks = 1;
 #ifdef DO_MPI
-static MPI_Request* requestList;
+static MPI_Request* requestList = NULL;
 #endif
 static int* rUsed;
 static int reqCount = 0;
@@ -94,6 +94,14 @@ void destroyParallel()
 #ifdef DO_MPI
 int saveRequest(MPI_Request req)
 {
+  // MPI started by bml_init, without initParallel
+  if (requestList == NULL)
+  {
+    MPI_Comm_size(MPI_COMM_WORLD, &nRanks);
+    requestList = (MPI_Request*) malloc(nRanks*sizeof(MPI_Request));
+    rUsed = (int*) calloc(nRanks, sizeof(int));
+  }
+
   for (int i = 0; i < nRanks; i++)
   {
     if (rUsed[i] == 0)
@@ -369,6 +377,37 @@ void addRealParallel(const real_t* sendBuf,
 #endif
 }
 
+/// Returns the request index to pass to waitIreduce. recvBuf must not
+/// be read before the wait.
+int iaddRealParallel(const real_t* sendBuf, 
+                     real_t* recvBuf, 
+                     const int count)
+{
+#ifdef DO_MPI
+   MPI_Request request;
+   MPI_Iallreduce(sendBuf, recvBuf, count, REAL_MPI_TYPE, MPI_SUM, 
+     MPI_COMM_WORLD, &request);
+
+   int rind = saveRequest(request);
+   return rind;
+#else
+   for (int ii=0; ii<count; ++ii)
+      recvBuf[ii] = sendBuf[ii];
+   return 0;
+#endif
+}
+
+void waitIreduce(int rind)
+{
+#ifdef DO_MPI
+  MPI_Status status;
+
+  MPI_Wait(&requestList[rind], &status);
+
+  rUsed[rind] = 0;
+#endif
+}
+
 void addDoubleParallel(const double* sendBuf, 
                        double* recvBuf,
                        const int count)
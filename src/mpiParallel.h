@@ -97,6 +97,14 @@ void addRealParallel(const real_t* sendBuf,
                      real_t* recvBuf, 
                      const int count);
 
+/// Wrapper for MPI_Iallreduce real sum, non-blocking reduction.
+int iaddRealParallel(const real_t* sendBuf, 
+                     real_t* recvBuf, 
+                     const int count);
+
+/// Wrapper for MPI_Wait on non-blocking reduction.
+void waitIreduce(int rind);
+
 /// Wrapper for MPI_Allreduce double sum.
 void addDoubleParallel(const double* sendBuf, 
                        double* recvBuf, 
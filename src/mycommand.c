@@ -39,6 +39,42 @@
 /// | \--gen        | -g          | 0             | generate H matrix if 1
 /// | \--dout       | -u          | 0             | write out density matrix if 1
 /// | \--dbg        | -d          | 0             | write debug messages if 1
+/// | \--nsteps     | -s          | 18            | recursion depth for FERMI and IMP (0-automatic, needs beta; IMP caps it by cgTol)
+/// | \--muCands    |             | 1             | concurrent mu candidates in SP2 Fermi init
+/// | \--muOrder    |             | 1             | mu step order in the SP2 Fermi loop (1-Newton, 2-Halley)
+/// | \--occProbes  |             | 0             | random probes for stochastic mu search (0-off)
+/// | \--kpmMoments |             | 256           | Chebyshev moments for stochastic mu search
+/// | \--lanczos    |             | 0             | Lanczos steps for spectral bounds (0-Gershgorin, else at least 5)
+/// | \--stopRule   |             | 0             | SP2 BASIC stopping rule (0-minIter, 1-error based, minIter as fallback)
+/// | \--purify     |             | 0             | BASIC purification (0-SP2, 1-TRS4, 2-canonical)
+/// | \--nsolves    |             | 1             | number of repeated solves
+/// | \--dh         |             | 0.0           | relative change of H between solves
+/// | \--replay     |             | 0             | replay SP2 sequence on repeated solves if 1
+/// | \--replayMargin |           | 1.0           | widening of the recorded SP2 bounds for replay
+/// | \--impMethod  |             | 0             | IMP linear solver (0-CG, 1-Newton-Schulz, 2-auto)
+/// | \--cgGuess    |             | 0             | IMP CG starting guess (0-previous P, 1-extrapolated)
+/// | \--cgPrec     |             | 0             | IMP CG preconditioner (0-none, 1-Jacobi, 2-approximate inverse)
+/// | \--cgMethod   |             | 0             | IMP CG variant (0-standard, 1-pipelined)
+/// | \--cgTol      |             | 1.0E-04       | IMP CG tolerance on the squared residual norm
+/// | \--cgSchedule |             | 0             | IMP CG tolerance (0-fixed cgTol, 1-per step from cgAcc)
+/// | \--cgAcc      |             | 1.0E-02       | IMP bound on the Frobenius error in P from the CG solves, with cgSchedule 1
+/// | \--chebDegree |             | 0             | CHEBYSHEV polynomial degree (0-automatic from beta)
+/// | \--chebKernel |             | 1             | CHEBYSHEV coefficient damping (0-none, 1-Jackson)
+/// | \--nresp      |             | 3             | number of RESPONSE perturbations
+/// | \--pertName   |             |               | RESPONSE perturbations read from pertName.k.mtx (generated if not set)
+/// | \--scfMethod  |             | 1             | KERNEL SCF update (0-linear mixing, 1-low-rank kernel)
+/// | \--kernelRank |             | 4             | KERNEL rank of the inverse Jacobian
+/// | \--hubbardU   |             | 1.0           | KERNEL charge coupling U in H = H0 + U*diag(q - q0)
+/// | \--scfTol     |             | 1.0E-05       | KERNEL rms charge residual tolerance
+/// | \--spammTol   |             | 0.0           | BASIC sp2Loop skips block products of X^2 with norm bound below spammTol (0-off)
+/// | \--diagMode   |             | 0             | DIAG solver choice (0-automatic from a quick benchmark, 1-DIAG, 2-SP2)
+/// | \--subBlock   |             | 32            | SUBMATRIX core rows per block
+/// | \--subHops    |             | 1             | SUBMATRIX neighborhood depth in the graph of H
+/// | \--subMethod  |             | 0             | SUBMATRIX block solver (0-diagonalization, 1-purification at mu)
+/// | \--nparts     |             | 16            | GRAPH number of parts
+/// | \--graphHops  |             | 2             | GRAPH halo depth in the graph of H
+/// | \--nslice     |             | 0             | BASIC sp2Loop reports the nslice eigenvalues nearest the Fermi level, HOMO and LUMO (0-off)
+/// | \--refName    |             |               | compare the density matrix with a reference, e.g. dmatrix.out.mtx of a DIAG run
 ///
 /// Notes: 
 /// 
@@ -96,6 +132,8 @@ Command parseCommandLine(int argc,
    Command cmd;
 
    memset(cmd.hmatName, 0, 1024);
+   memset(cmd.pertName, 0, 1024);
+   memset(cmd.refName, 0, 1024);
    cmd.N = 1600;
    cmd.M = 1600;
    cmd.mtype = 2;
@@ -105,6 +143,32 @@ Command parseCommandLine(int argc,
    cmd.maxsp2iter = 100;
    cmd.nsteps = 18;
    cmd.osteps = 0;
+   cmd.muCands = 1;
+   cmd.muOrder = 1;
+   cmd.occProbes = 0;
+   cmd.kpmMoments = 256;
+   cmd.lanczos = 0;
+   cmd.stopRule = 0;
+   cmd.purify = 0;
+   cmd.nsolves = 1;
+   cmd.replay = 0;
+   cmd.impMethod = 0;
+   cmd.cgGuess = 0;
+   cmd.cgPrec = 0;
+   cmd.cgMethod = 0;
+   cmd.cgSchedule = 0;
+   cmd.chebDegree = 0;
+   cmd.chebKernel = 1;
+   cmd.nresp = 3;
+   cmd.scfMethod = 1;
+   cmd.kernelRank = 4;
+   cmd.diagMode = 0;
+   cmd.subBlock = 32;
+   cmd.subHops = 1;
+   cmd.subMethod = 0;
+   cmd.nparts = 16;
+   cmd.graphHops = 2;
+   cmd.nslice = 0;
    cmd.debug = 0;
    cmd.nocc = 0.0;
    cmd.eps = 1.0E-05;
@@ -115,6 +179,13 @@ Command parseCommandLine(int argc,
    cmd.tscale = 1.0;
    cmd.occLimit = 1.0E-09;
    cmd.traceLimit = 1.0E-12;
+   cmd.dh = 0.0;
+   cmd.replayMargin = 1.0;
+   cmd.cgTol = 1.0E-04;
+   cmd.cgAcc = 1.0E-02;
+   cmd.hubbardU = 1.0;
+   cmd.scfTol = 1.0E-05;
+   cmd.spammTol = 0.0;
 
    int help=0;
    // add arguments for processing.  Please update the html documentation too!
@@ -125,7 +196,7 @@ Command parseCommandLine(int argc,
    addArg("mtype",      'y', 1, 'i',  &(cmd.mtype),        0,             "matrix type (1-dense,2-ellpack)");
    addArg("minIter",    'w', 1, 'i',  &(cmd.minsp2iter),   0,             "min sp2 iters");
    addArg("maxIter",    'x', 1, 'i',  &(cmd.maxsp2iter),   0,             "max sp2 iters");
-   addArg("nsteps",     's', 1, 'i',  &(cmd.nsteps),       0,             "num sp2 iters");
+   addArg("nsteps",     's', 1, 'i',  &(cmd.nsteps),       0,             "num sp2 iters (0-automatic)");
    addArg("occSteps",   'c', 1, 'i',  &(cmd.osteps),       0,             "num occ iters");
    addArg("gen",        'g', 1, 'i',  &(cmd.gen),          0,             "generate H matrix");
    addArg("dout",       'u', 1, 'i',  &(cmd.dout),         0,             "write out density matrix");
@@ -139,6 +210,41 @@ Command parseCommandLine(int argc,
    addArg("traceLimit", 'a', 1, 'd',  &(cmd.traceLimit),   0,             "trace limit");
    addArg("occLimit",   'r', 1, 'd',  &(cmd.occLimit),     0,             "occ err limit");
    addArg("mu",         'p', 1, 'd',  &(cmd.mu),           0,             "mu");
+   addArg("muCands",     0,  1, 'i',  &(cmd.muCands),      0,             "concurrent mu candidates");
+   addArg("muOrder",     0,  1, 'i',  &(cmd.muOrder),      0,             "sp2Loop mu step order (1-Newton,2-Halley)");
+   addArg("occProbes",   0,  1, 'i',  &(cmd.occProbes),    0,             "random probes for mu search");
+   addArg("kpmMoments",  0,  1, 'i',  &(cmd.kpmMoments),   0,             "Chebyshev moments for mu search");
+   addArg("lanczos",     0,  1, 'i',  &(cmd.lanczos),      0,             "Lanczos steps for bounds (0-Gershgorin)");
+   addArg("stopRule",    0,  1, 'i',  &(cmd.stopRule),     0,             "SP2 stopping rule (0-minIter,1-error)");
+   addArg("purify",      0,  1, 'i',  &(cmd.purify),       0,             "purification (0-SP2,1-TRS4,2-canonical)");
+   addArg("nsolves",     0,  1, 'i',  &(cmd.nsolves),      0,             "number of repeated solves");
+   addArg("dh",          0,  1, 'd',  &(cmd.dh),           0,             "relative change of H between solves");
+   addArg("replay",      0,  1, 'i',  &(cmd.replay),       0,             "replay SP2 sequence on repeated solves");
+   addArg("replayMargin",0,  1, 'd',  &(cmd.replayMargin), 0,             "widening of recorded bounds for replay");
+   addArg("impMethod",   0,  1, 'i',  &(cmd.impMethod),    0,             "IMP solver (0-CG,1-Newton-Schulz,2-auto)");
+   addArg("cgGuess",     0,  1, 'i',  &(cmd.cgGuess),      0,             "IMP CG guess (0-previous,1-extrapolated)");
+   addArg("cgPrec",      0,  1, 'i',  &(cmd.cgPrec),       0,             "IMP CG preconditioner (0-none,1-Jacobi,2-AINV)");
+   addArg("cgMethod",    0,  1, 'i',  &(cmd.cgMethod),     0,             "IMP CG variant (0-standard,1-pipelined)");
+   addArg("cgTol",       0,  1, 'd',  &(cmd.cgTol),        0,             "IMP CG tolerance");
+   addArg("cgSchedule",  0,  1, 'i',  &(cmd.cgSchedule),   0,             "IMP CG tolerance (0-fixed,1-from cgAcc)");
+   addArg("cgAcc",       0,  1, 'd',  &(cmd.cgAcc),        0,             "IMP CG error bound on P for cgSchedule");
+   addArg("chebDegree",  0,  1, 'i',  &(cmd.chebDegree),   0,             "CHEBYSHEV degree (0-automatic)");
+   addArg("chebKernel",  0,  1, 'i',  &(cmd.chebKernel),   0,             "CHEBYSHEV damping (0-none,1-Jackson)");
+   addArg("nresp",       0,  1, 'i',  &(cmd.nresp),        0,             "RESPONSE perturbations");
+   addArg("pertName",    0,  1, 's',  cmd.pertName,   sizeof(cmd.pertName), "RESPONSE perturbation file base name");
+   addArg("scfMethod",   0,  1, 'i',  &(cmd.scfMethod),    0,             "KERNEL SCF update (0-mixing,1-kernel)");
+   addArg("kernelRank",  0,  1, 'i',  &(cmd.kernelRank),   0,             "KERNEL inverse Jacobian rank");
+   addArg("hubbardU",    0,  1, 'd',  &(cmd.hubbardU),     0,             "KERNEL charge coupling U");
+   addArg("scfTol",      0,  1, 'd',  &(cmd.scfTol),       0,             "KERNEL charge residual tolerance");
+   addArg("spammTol",    0,  1, 'd',  &(cmd.spammTol),     0,             "SpAMM block product tolerance (0-off)");
+   addArg("diagMode",    0,  1, 'i',  &(cmd.diagMode),     0,             "DIAG solver (0-auto,1-DIAG,2-SP2)");
+   addArg("subBlock",    0,  1, 'i',  &(cmd.subBlock),     0,             "SUBMATRIX core rows per block");
+   addArg("subHops",     0,  1, 'i',  &(cmd.subHops),      0,             "SUBMATRIX neighborhood depth");
+   addArg("subMethod",   0,  1, 'i',  &(cmd.subMethod),    0,             "SUBMATRIX block solver (0-diag,1-purify)");
+   addArg("nparts",      0,  1, 'i',  &(cmd.nparts),       0,             "GRAPH number of parts");
+   addArg("graphHops",   0,  1, 'i',  &(cmd.graphHops),    0,             "GRAPH halo depth");
+   addArg("nslice",      0,  1, 'i',  &(cmd.nslice),       0,             "eigenvalues sliced near the gap (0-off)");
+   addArg("refName",     0,  1, 's',  cmd.refName,    sizeof(cmd.refName), "reference density matrix file");
    processArgs(argc,argv);
 
    // If user didn't set hmatName, set to generate H matrix.
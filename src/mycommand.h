@@ -13,6 +13,8 @@
 typedef struct CommandSt
 {
    char hmatName[1024]; //!< name of the dense H matrix file
+   char pertName[1024]; //!< base name of the RESPONSE perturbation files
+   char refName[1024];  //!< name of the reference density matrix file
    int N;               //!< number of rows in H matrix (N x N)
    int M;               //!< max number of non-zeroes in H matrix row
    int mtype;           //!< matrix type (1-dense, 2-ellpack, ...)
@@ -23,6 +25,32 @@ typedef struct CommandSt
    int debug;           //!< if == 1, write out debug messages
    int nsteps;          //!< number of SP2 steps
    int osteps;          //!< number of occupation loop steps
+   int muCands;         //!< number of concurrent mu candidates
+   int muOrder;         //!< order of the sp2Loop mu step (1-Newton, 2-Halley)
+   int occProbes;       //!< random probes for stochastic mu search
+   int kpmMoments;      //!< Chebyshev moments for stochastic mu search
+   int lanczos;         //!< Lanczos steps for spectral bounds, 0 for Gershgorin
+   int stopRule;        //!< SP2 stopping rule (0-minIter, 1-error based)
+   int purify;          //!< purification for BASIC (0-SP2, 1-TRS4, 2-canonical)
+   int nsolves;         //!< number of repeated solves
+   int replay;          //!< if == 1, replay the recorded SP2 sequence
+   int impMethod;       //!< IMP linear solver (0-CG, 1-Newton-Schulz, 2-auto)
+   int cgGuess;         //!< IMP CG starting guess (0-previous P, 1-extrapolated)
+   int cgPrec;          //!< IMP CG preconditioner (0-none, 1-Jacobi, 2-approx inverse)
+   int cgMethod;        //!< IMP CG variant (0-standard, 1-pipelined)
+   int cgSchedule;      //!< IMP CG tolerance (0-fixed, 1-per step from cgAcc)
+   int chebDegree;      //!< CHEBYSHEV polynomial degree (0-automatic)
+   int chebKernel;      //!< CHEBYSHEV damping (0-none, 1-Jackson)
+   int nresp;           //!< number of RESPONSE perturbations
+   int scfMethod;       //!< KERNEL SCF update (0-linear mixing, 1-kernel)
+   int kernelRank;      //!< KERNEL rank of the inverse Jacobian
+   int diagMode;        //!< DIAG solver choice (0-automatic, 1-DIAG, 2-SP2)
+   int subBlock;        //!< SUBMATRIX core rows per block
+   int subHops;         //!< SUBMATRIX neighborhood depth in the graph of H
+   int subMethod;       //!< SUBMATRIX block solver (0-diagonalization, 1-purification)
+   int nparts;          //!< GRAPH number of parts
+   int graphHops;       //!< GRAPH halo depth in the graph of H
+   int nslice;          //!< BASIC eigenvalues sliced from SP2 iterates (0-off)
 
    real_t nocc;         //!< number of occupied states
    real_t eps;          //!< threshold for sparse math 
@@ -33,6 +61,13 @@ typedef struct CommandSt
    real_t beta;         //!< 1/KBT
    real_t occLimit;     //!< occupation error limit
    real_t traceLimit;   //!< trace comparison limit
+   real_t dh;           //!< relative change of H between solves
+   real_t replayMargin; //!< widening of the recorded SP2 bounds for replay
+   real_t cgTol;        //!< IMP CG tolerance on the squared residual norm
+   real_t cgAcc;        //!< IMP bound on the CG error in P with schedule
+   real_t hubbardU;     //!< KERNEL charge coupling U in H = H0 + U*diag(q - q0)
+   real_t scfTol;       //!< KERNEL rms charge residual tolerance
+   real_t spammTol;     //!< BASIC SpAMM block product tolerance (0-off)
 } Command;
 
 /// Process command line arguments into an easy to handle structure.
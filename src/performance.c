@@ -34,6 +34,9 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "parallel.h"
 #include "mytype.h"
@@ -58,6 +61,8 @@ char* timerName[numberOfTimers] = {
    "    x2I",
    "    mmI",
    "    xaddI",
+   "    muSearchI",
+   "    stochI",
    "  sp2Loop",
    "    copy",
    "    norm",
@@ -71,7 +76,16 @@ char* timerName[numberOfTimers] = {
    "    dense",
    "    inverse",
    "    nsiter",
-   "    linsyssetup" 
+   "    linsyssetup",
+   "    alloc",
+   "    cg",
+   "  response",
+   "  diag",
+   "  bench",
+   "  subsolve",
+   "  assemble",
+   "  partition",
+   "  slice"
 };
 
 /// Timer data collected.  Also facilitates computing averages and
@@ -129,13 +143,21 @@ typedef struct CounterSt
 
 static Counter perfCounter[numberOfCounters];
 
+/// Timers are not thread safe. Calls made inside an OpenMP parallel
+/// region are ignored; time the enclosing region instead.
 void profileStart(const enum TimerHandle handle)
 {
+#ifdef _OPENMP
+   if (omp_in_parallel()) return;
+#endif
    perfTimer[handle].start = getTime();
 }
 
 void profileStop(const enum TimerHandle handle)
 {
+#ifdef _OPENMP
+   if (omp_in_parallel()) return;
+#endif
    perfTimer[handle].count += 1;
    uint64_t delta = getTime() - perfTimer[handle].start;
    perfTimer[handle].total += delta;
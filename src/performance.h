@@ -18,6 +18,8 @@ enum TimerHandle{
    x2InitTimer,
    mmInitTimer,
    xaddInitTimer,
+   muSearchInitTimer,
+   stochInitTimer,
    sp2LoopTimer, 
    copyTimer,
    normTimer,
@@ -32,6 +34,15 @@ enum TimerHandle{
    inverseTimer,
    nsiterTimer,
    linsyssetupTimer,
+   allocTimer,
+   cgTimer,
+   responseTimer,
+   diagTimer,
+   benchTimer,
+   subsolveTimer,
+   assembleTimer,
+   partitionTimer,
+   sliceTimer,
    numberOfTimers,
    };
 
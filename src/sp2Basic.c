@@ -14,36 +14,213 @@
 #include "performance.h"
 #include "parallel.h"
 #include "constants.h"
+#include "lanczos.h"
+#include "spamm.h"
+#include "csrMatrix.h"
+#include "spectrumSlice.h"
+
+/// Accepted error of a replayed solve, relative to the recorded one
+#define REPLAY_TOLERANCE 10.0
+
+/// Steps without a new smallest idempotency error after which TRS4 and
+/// canonical purification stop
+#define PURIFY_STALL 3
 
 /// \details
 /// Normalize a Hamiltonian matrix prior to running the SP2 algorithm.
 /// 
 /// X0 = (e_max * I - H) / (e_max - e_min)
 /// 
-/// where e_max and e_min are obtained using the Gershgorin circle theorem.
+/// where e_max and e_min are obtained using the Gershgorin circle theorem,
+/// or from Lanczos when selected (see spectralBounds).
 ///
-void normalize(bml_matrix_t* h_bml)
+void normalize(bml_matrix_t* h_bml,
+               const real_t nocc,
+               const real_t threshold)
+{
+  real_t* gbnd = spectralBounds(h_bml, nocc, threshold);
+  normalizeBounds(h_bml, gbnd[0], gbnd[1]);
+
+  bml_free_memory(gbnd);
+}
+
+/// \details
+/// Normalize a Hamiltonian matrix with given spectral bounds,
+/// X0 = (emax * I - H) / (emax - emin).
+void normalizeBounds(bml_matrix_t* h_bml,
+                     const real_t emin,
+                     const real_t emax)
 {
   real_t alpha, beta, maxMinusMin;
 
-  real_t* gbnd = bml_gershgorin(h_bml);
-  maxMinusMin = gbnd[1] - gbnd[0];
+  maxMinusMin = emax - emin;
   alpha = MINUS_ONE / maxMinusMin;
-  beta = gbnd[1] / maxMinusMin;
+  beta = emax / maxMinusMin;
   bml_scale_add_identity(h_bml, alpha, beta, ZERO);
+}
 
-  bml_free_memory(gbnd);
+/// \details
+/// One SP2 iteration with the trace work fused into the multiply.
+///
+/// bml_multiply_x2 returns the traces of X and X^2 from the same pass
+/// that forms X^2, so no separate trace pass over X is needed. The branch
+/// is then chosen from the (reduced) traces and applied in place.
+///
+/// The X = X^2 branch swaps the two handles instead of copying, so on
+/// return *x_bml always points at the current X and *x2_bml at the
+/// scratch buffer.
+///
+/// Returns 1 for X = 2X - X^2, -1 for X = X^2, and 0 when neither branch
+/// moves the occupation closer to nocc (converged).
+int sp2Step(bml_matrix_t** x_bml,
+            bml_matrix_t** x2_bml,
+            const real_t nocc,
+            const real_t idemTol,
+            const real_t threshold,
+            real_t* trX,
+            real_t* trX2)
+{
+  real_t tr2XX2, limDiff;
+
+  // Matrix multiply X^2, traces of X and X^2 from the same pass
+  startTimer(x2Timer);
+  real_t* trace = bml_multiply_x2(*x_bml, *x2_bml, threshold);
+  *trX = trace[0];
+  *trX2 = trace[1];
+  bml_free_memory(trace);
+  stopTimer(x2Timer);
+
+#ifdef DO_MPI
+  // Reduce trace of X and X^2 across all processors
+  if (bml_getNRanks() > 1)
+  {
+    startTimer(reduceCommTimer);
+    addRealReduce2(trX, trX2);
+    stopTimer(reduceCommTimer);
+    collectCounter(reduceCounter, 2 * sizeof(real_t));
+  }
+#endif
+
+  tr2XX2 = TWO * (*trX) - (*trX2);
+  limDiff = ABS(*trX2 - nocc) - ABS(tr2XX2 - nocc);
+
+  if (limDiff > idemTol)
+  {
+    // X = 2 * X - X^2
+    startTimer(xaddTimer);
+    bml_add(*x_bml, *x2_bml, TWO, MINUS_ONE, threshold);
+    stopTimer(xaddTimer);
+
+    return 1;
+  }
+  else if (limDiff < -idemTol)
+  {
+    // X = X^2, swap buffers
+    bml_matrix_t* tmp_bml = *x_bml;
+    *x_bml = *x2_bml;
+    *x2_bml = tmp_bml;
+
+    return -1;
+  }
+
+  return 0;
+}
+
+/// \details
+/// sp2Step on block copies of X and X^2, with X^2 from a SpAMM product
+/// screened at spammTol_i (see spamm.c). The leaf products formed and
+/// skipped are added to products and skipped.
+static int spammStep(SpammMatrix** xs,
+                     SpammMatrix** x2s,
+                     const real_t nocc,
+                     const real_t idemTol,
+                     const real_t threshold,
+                     real_t* trX,
+                     real_t* trX2,
+                     long* products,
+                     long* skipped)
+{
+  startTimer(x2Timer);
+  spammMultiply(*xs, *xs, *x2s, spammTol_i, threshold, products, skipped);
+  *trX = spammTrace(*xs);
+  *trX2 = spammTrace(*x2s);
+  stopTimer(x2Timer);
+
+  real_t tr2XX2 = TWO * (*trX) - (*trX2);
+  real_t limDiff = ABS(*trX2 - nocc) - ABS(tr2XX2 - nocc);
+
+  if (limDiff > idemTol)
+  {
+    // X = 2 * X - X^2
+    startTimer(xaddTimer);
+    spammAdd(*xs, *x2s, TWO, MINUS_ONE, threshold);
+    stopTimer(xaddTimer);
+
+    return 1;
+  }
+  else if (limDiff < -idemTol)
+  {
+    // X = X^2, swap buffers
+    SpammMatrix* tmp = *xs;
+    *xs = *x2s;
+    *x2s = tmp;
+
+    return -1;
+  }
+
+  return 0;
+}
+
+/// \details
+/// CSR copy of the X that entered the last SP2 step, rebuilt from the
+/// X and X^2 left by a step with the given branch.
+static CsrMatrix* sliceCapture(const bml_matrix_t* x_bml,
+                               const bml_matrix_t* x2_bml,
+                               const int branch,
+                               const real_t threshold)
+{
+  if (branch == -1)
+    return csrFromBml(x2_bml, threshold);
+  if (branch == 0)
+    return csrFromBml(x_bml, threshold);
+
+  // X = ((2X - X^2) + X^2) / 2
+  bml_matrix_t* xold_bml = bml_copy_new(x_bml);
+  bml_add(xold_bml, x2_bml, HALF, HALF, threshold);
+  CsrMatrix* x = csrFromBml(xold_bml, threshold);
+  bml_deallocate(&xold_bml);
+
+  return x;
 }
 
 /// \details
 /// The second order spectral projection algorithm.
-void sp2Loop(const bml_matrix_t* h_bml, 
-             bml_matrix_t* rho_bml, 
-             const real_t nocc,
-             const int minsp2iter, 
-             const int maxsp2iter, 
-             const real_t idemTol, 
-             const real_t threshold)
+///
+/// If seq is not NULL the branch sequence is recorded for sp2Replay.
+/// The bounds are then widened by replayMargin_i about their center,
+/// so the recorded normalization still holds the spectrum of a
+/// slightly different H.
+///
+/// With spammTol_i > 0 the loop works on block copies of X and X^2
+/// and forms X^2 by norm-screened multiplication (see spammStep), and
+/// the fraction of leaf block products skipped is reported.
+///
+/// With nslice_i > 0 the first X with Tr(X - X^2) below SLICE_FILL
+/// per wanted state (or the last one) is kept, and spectrumSlice
+/// extracts the nslice_i eigenvalues nearest the Fermi level from it.
+///
+/// A step with Tr(X^2) > Tr(X) + 1/2 under Lanczos bounds restarts the
+/// loop with Gershgorin bounds (see rejectLanczosBounds).
+///
+/// Returns the number of iterations, each of which forms one X^2.
+int sp2Loop(const bml_matrix_t* h_bml, 
+            bml_matrix_t* rho_bml, 
+            const real_t nocc,
+            const int minsp2iter, 
+            const int maxsp2iter, 
+            const real_t idemTol, 
+            const real_t threshold,
+            Sp2Sequence* seq)
 {
   //DataExchange* dataExchange;
 
@@ -54,10 +231,24 @@ void sp2Loop(const bml_matrix_t* h_bml,
 //    dataExchange = initDataExchange(domain);
 #endif
 
-  // Do gershgorin normalization
+  // Do spectral bounds normalization
   startTimer(normTimer);
   bml_copy(h_bml, rho_bml);
-  normalize(rho_bml);
+  if (seq == NULL)
+  {
+    normalize(rho_bml, nocc, threshold);
+  }
+  else
+  {
+    real_t* gbnd = spectralBounds(h_bml, nocc, threshold);
+    real_t center = HALF * (gbnd[1] + gbnd[0]);
+    real_t halfWidth = HALF * replayMargin_i * (gbnd[1] - gbnd[0]);
+    seq->emin = center - halfWidth;
+    seq->emax = center + halfWidth;
+    seq->nsteps = 0;
+    normalizeBounds(rho_bml, seq->emin, seq->emax);
+    bml_free_memory(gbnd);
+  }
   stopTimer(normTimer);
   
   // Basic SP2 algorithm
@@ -69,23 +260,45 @@ void sp2Loop(const bml_matrix_t* h_bml,
   real_t trX = ZERO;
   real_t trX2 = ZERO;
 
-  real_t tr2XX2, trXOLD, limDiff;
+  real_t trXOLD;
 
-  real_t* trace;
+  // Idempotency error estimates |Tr(X) - Tr(X^2)| of the last three
+  // iterations, for the error-based stopping rule
+  real_t idemErrN = ZERO;
+  real_t idemErrN1 = ZERO;
+  real_t idemErrN2 = ZERO;
 
   int iter = 0;
+  int branch;
+  int branchOld = 0;
   int breakLoop = 0;
 
+  // Why the loop stopped: 0 maxIter, 1 error rule, 2 minIter rule,
+  // 3 no branch improves the occupation
+  int stopBy = 0;
+
   if (bml_printRank() && debug_i == 1)
     printf("\nSP2Loop:\n");
 
-  // X2 <- X
+  // X starts in rho, X2 <- X
+  bml_matrix_t* x_bml = rho_bml;
   bml_matrix_t* x2_bml = bml_copy_new(rho_bml);
 
-  while ( breakLoop == 0 && iter < maxsp2iter )
+  SpammMatrix* xs = NULL;
+  SpammMatrix* x2s = NULL;
+  long spammProducts = 0;
+  long spammSkipped = 0;
+  if (spammTol_i > ZERO)
   {
-    trX = bml_trace(rho_bml);
+    xs = spammFromBml(rho_bml, SPAMM_LEAF, threshold);
+    x2s = spammZero(xs->N, SPAMM_LEAF);
+  }
+
+  CsrMatrix* xslice = NULL;
+  int sliceIter = 0;
 
+  while ( breakLoop == 0 && iter < maxsp2iter )
+  {
 #ifdef DO_MPI
     if (bml_getNRanks() > 1)
     {
@@ -95,54 +308,48 @@ void sp2Loop(const bml_matrix_t* h_bml,
     }
 #endif
 
-    // Matrix multiply X^2
-    startTimer(x2Timer);
-    trace = bml_multiply_x2(rho_bml, x2_bml, threshold);
-    trX2 = trace[1];
-    bml_free_memory(trace);
-    stopTimer(x2Timer);
-
-#ifdef DO_MPI
-    // Reduce trace of X and X^2 across all processors
-    if (bml_getNRanks() > 1)
-    {
-      startTimer(reduceCommTimer);
-      addRealReduce2(&trX, &trX2);
-      stopTimer(reduceCommTimer);
-      collectCounter(reduceCounter, 2 * sizeof(real_t));
-    }
-#endif
+    // X^2, traces of X and X^2, and branch update
+    if (xs != NULL)
+      branch = spammStep(&xs, &x2s, nocc, idemTol, threshold, &trX, &trX2,
+        &spammProducts, &spammSkipped);
+    else
+      branch = sp2Step(&x_bml, &x2_bml, nocc, idemTol, threshold, &trX, &trX2);
 
     if (bml_printRank() && debug_i == 1) 
       printf("iter = %d  trX = %e  trX2 = %e\n", iter, trX, trX2);
- 
-    tr2XX2 = TWO*trX - trX2;
-    trXOLD = trX;
-    limDiff = ABS(trX2 - nocc) - ABS(tr2XX2 - nocc);
 
-    if (limDiff > idemTol) 
+    // Tr(X^2) > Tr(X) means X has eigenvalues outside [0,1], from
+    // Lanczos bounds that missed part of the spectrum. Start over with
+    // Gershgorin bounds.
+    if (trX2 - trX > HALF && rejectLanczosBounds())
     {
-      // X = 2 * X - X^2
-      trX = TWO * trX - trX2;
-
-      startTimer(xaddTimer);
-      bml_add(rho_bml, x2_bml, TWO, MINUS_ONE, threshold);
-      stopTimer(xaddTimer);
+      bml_deallocate((x_bml == rho_bml) ? &x2_bml : &x_bml);
+      if (xs != NULL)
+      {
+        spammDestroy(&xs);
+        spammDestroy(&x2s);
+      }
+      if (xslice != NULL)
+        csrDestroy(&xslice);
+      stopTimer(sp2LoopTimer);
+
+      return iter + 1 + sp2Loop(h_bml, rho_bml, nocc, minsp2iter, maxsp2iter,
+        idemTol, threshold, seq);
     }
-    else if (limDiff < -idemTol)
-    {
-      // X = X^2
+ 
+    trXOLD = trX;
+    if (branch == 1)
+      trX = TWO * trX - trX2;
+    else if (branch == -1)
       trX = trX2;
-
-      startTimer(xsetTimer);
-      bml_copy(x2_bml, rho_bml);
-      stopTimer(xsetTimer);
-    }
-    else 
+    else
     {
-      trX = trXOLD;
       breakLoop = 1;
+      stopBy = 3;
     }
+
+    if (seq != NULL && branch != 0)
+      seq->branch[seq->nsteps++] = branch;
          
     idempErr2 = idempErr1;
     idempErr1 = idempErr;
@@ -150,7 +357,51 @@ void sp2Loop(const bml_matrix_t* h_bml,
 
     iter++;
 
-    if (iter >= minsp2iter && (idempErr >= idempErr2)) breakLoop = 1;
+    idemErrN2 = idemErrN1;
+    idemErrN1 = idemErrN;
+    idemErrN = ABS(trXOLD - trX2);
+
+    // Parameterless stop (Kruskal et al.): in exact arithmetic two
+    // alternating steps square the idempotency error, e_n ~ 4*e_n-2^2.
+    // Once the measured error exceeds that, numerical error dominates.
+    // The minIter test stays as the fallback for inputs whose error
+    // never decays quadratically, such as gapless ones.
+    if (breakLoop == 0 && stopRule_i == 1 && iter >= 3 && 
+        branch != branchOld && idemErrN > 4.0 * idemErrN2 * idemErrN2)
+    {
+      breakLoop = 1;
+      stopBy = 1;
+    }
+    if (breakLoop == 0 && iter >= minsp2iter && (idempErr >= idempErr2))
+    {
+      breakLoop = 1;
+      stopBy = 2;
+    }
+    branchOld = branch;
+
+    // Keep the X of this step for spectrum slicing
+    if (nslice_i > 0 && xslice == NULL &&
+        (idemErrN <= SLICE_FILL * nslice_i || breakLoop == 1 ||
+         iter == maxsp2iter))
+    {
+      startTimer(sliceTimer);
+      if (xs != NULL)
+      {
+        bml_matrix_t* xt_bml = bml_copy_new(x_bml);
+        bml_matrix_t* x2t_bml = bml_copy_new(x_bml);
+        spammToBml(xs, xt_bml, threshold);
+        spammToBml(x2s, x2t_bml, threshold);
+        xslice = sliceCapture(xt_bml, x2t_bml, branch, threshold);
+        bml_deallocate(&xt_bml);
+        bml_deallocate(&x2t_bml);
+      }
+      else
+      {
+        xslice = sliceCapture(x_bml, x2_bml, branch, threshold);
+      }
+      sliceIter = iter - 1;
+      stopTimer(sliceTimer);
+    }
 
     // Exchange matrix pieces across processors
 #ifdef DO_MPI
@@ -163,8 +414,60 @@ void sp2Loop(const bml_matrix_t* h_bml,
 #endif
   }
 
+  if (xs != NULL)
+  {
+    startTimer(xsetTimer);
+    spammToBml(xs, rho_bml, threshold);
+    spammToBml(x2s, x2_bml, threshold);
+    stopTimer(xsetTimer);
+    spammDestroy(&xs);
+    spammDestroy(&x2s);
+
+    if (bml_printRank())
+      printf("SpAMM: skipped %ld of %ld leaf block products (%lg%%)\n",
+        spammSkipped, spammProducts + spammSkipped, 
+        100.0 * spammSkipped / MAX(spammProducts + spammSkipped, 1));
+  }
+
+  // Final X may sit in the scratch buffer after an odd number of swaps
+  if (x_bml != rho_bml)
+  {
+    startTimer(xsetTimer);
+    bml_copy(x_bml, rho_bml);
+    stopTimer(xsetTimer);
+    x2_bml = x_bml;
+  }
+
   stopTimer(sp2LoopTimer);
 
+  if (seq != NULL)
+    seq->idempErr = idemErrN;
+
+  if (bml_printRank())
+  {
+    printf("Final idempotency error |Tr(X) - Tr(X^2)| = %e\n", idemErrN);
+    if (stopRule_i == 1 && stopBy == 1)
+      printf("Error-based stop after %d iterations, at least %d fewer "
+        "than the minIter rule (minIter = %d)\n", iter, 
+        MIN(MAX(minsp2iter - iter, 1), maxsp2iter - iter), minsp2iter);
+    else if (stopRule_i == 1 && stopBy == 2)
+      printf("Error-based rule did not fire, minIter rule stop after %d "
+        "iterations\n", iter);
+    else if (stopRule_i == 1 && stopBy == 0)
+      printf("Error-based rule did not fire, stopped at maxIter = %d\n", 
+        maxsp2iter);
+    else if (stopRule_i == 1)
+      printf("Converged after %d iterations\n", iter);
+  }
+
+  if (xslice != NULL)
+  {
+    startTimer(sliceTimer);
+    spectrumSlice(h_bml, xslice, nslice_i, sliceIter);
+    stopTimer(sliceTimer);
+    csrDestroy(&xslice);
+  }
+
   // Multiply by 2
   bml_scale_inplace(&TWO, rho_bml);
   
@@ -182,6 +485,434 @@ void sp2Loop(const bml_matrix_t* h_bml,
     //destroyDataExchange(dataExchange);
 #endif
   bml_deallocate(&x2_bml);
+
+  return iter;
+}
+
+/// \details
+/// Replay a recorded SP2 branch sequence on a new H.
+///
+/// The steps are the same as in sp2Loop, but the traces from each
+/// multiply are neither reduced nor used, so there is no global
+/// synchronization inside the loop. The result is checked once at the
+/// end: the occupation and idempotency errors must be within
+/// REPLAY_TOLERANCE times the final idempotency error of the recorded
+/// solve. Returns 1 if the result is accepted. Otherwise returns 0
+/// and rho_bml must be recomputed, e.g. by sp2Loop.
+int sp2Replay(const bml_matrix_t* h_bml,
+              bml_matrix_t* rho_bml,
+              const real_t nocc,
+              const Sp2Sequence* seq,
+              const real_t idemTol,
+              const real_t threshold)
+{
+  startTimer(sp2LoopTimer);
+
+  // The recorded bounds must still hold the spectrum, or X0 leaves
+  // [0,1] and the replayed steps diverge
+  startTimer(normTimer);
+  real_t* gbnd = spectralBounds(h_bml, nocc, threshold);
+  int inside = (gbnd[0] >= seq->emin && gbnd[1] <= seq->emax);
+  bml_free_memory(gbnd);
+
+  if (!inside)
+  {
+    stopTimer(normTimer);
+    stopTimer(sp2LoopTimer);
+    if (bml_printRank())
+      printf("Replay rejected: spectrum outside recorded bounds\n");
+    return 0;
+  }
+
+  bml_copy(h_bml, rho_bml);
+  normalizeBounds(rho_bml, seq->emin, seq->emax);
+  stopTimer(normTimer);
+
+  bml_matrix_t* x_bml = rho_bml;
+  bml_matrix_t* x2_bml = bml_copy_new(rho_bml);
+
+  for (int i = 0; i < seq->nsteps; i++)
+  {
+    startTimer(x2Timer);
+    real_t* trace = bml_multiply_x2(x_bml, x2_bml, threshold);
+    bml_free_memory(trace);
+    stopTimer(x2Timer);
+
+    if (seq->branch[i] == 1)
+    {
+      // X = 2 * X - X^2
+      startTimer(xaddTimer);
+      bml_add(x_bml, x2_bml, TWO, MINUS_ONE, threshold);
+      stopTimer(xaddTimer);
+    }
+    else
+    {
+      // X = X^2, swap buffers
+      bml_matrix_t* tmp_bml = x_bml;
+      x_bml = x2_bml;
+      x2_bml = tmp_bml;
+    }
+  }
+
+  // Single convergence check, Tr(X^2) = ||X||_F^2 for symmetric X
+  real_t trX = bml_trace(x_bml);
+  real_t trX2 = bml_sum_squares(x_bml);
+
+#ifdef DO_MPI
+  if (bml_getNRanks() > 1)
+  {
+    startTimer(reduceCommTimer);
+    addRealReduce2(&trX, &trX2);
+    stopTimer(reduceCommTimer);
+    collectCounter(reduceCounter, 2 * sizeof(real_t));
+  }
+#endif
+
+  real_t occErr = ABS(trX - nocc);
+  real_t idempErr = ABS(trX - trX2);
+  real_t tol = REPLAY_TOLERANCE * MAX(seq->idempErr, idemTol);
+  int accepted = (occErr <= tol && idempErr <= tol);
+
+  if (x_bml != rho_bml)
+  {
+    startTimer(xsetTimer);
+    bml_copy(x_bml, rho_bml);
+    stopTimer(xsetTimer);
+    x2_bml = x_bml;
+  }
+
+  stopTimer(sp2LoopTimer);
+
+  if (bml_printRank())
+    printf("Replay %s: %d steps, occupation error = %e, "
+      "idempotency error = %e\n", accepted ? "accepted" : "rejected", 
+      seq->nsteps, occErr, idempErr);
+
+  if (accepted)
+  {
+    // Multiply by 2
+    bml_scale_inplace(&TWO, rho_bml);
+
+    reportResults(seq->nsteps, rho_bml, x2_bml);
+  }
+
+  bml_deallocate(&x2_bml);
+
+  return accepted;
+}
+
+/// \details
+/// Common end of the higher order purification loops. The final X and
+/// X^2 may sit in any of the three work buffers; X is moved into
+/// rho_bml, doubled and reported with its square, then the two work
+/// buffers are freed.
+static void finishPurify(const int iter,
+                         bml_matrix_t* rho_bml,
+                         bml_matrix_t* x_bml,
+                         bml_matrix_t* x2_bml,
+                         bml_matrix_t* t_bml)
+{
+  if (x_bml != rho_bml)
+  {
+    startTimer(xsetTimer);
+    if (x2_bml == rho_bml)
+    {
+      bml_copy(x2_bml, t_bml);
+      x2_bml = t_bml;
+    }
+    bml_copy(x_bml, rho_bml);
+    stopTimer(xsetTimer);
+    t_bml = x_bml;
+  }
+
+  // Multiply by 2
+  bml_scale_inplace(&TWO, rho_bml);
+
+  // Report results
+  reportResults(iter, rho_bml, x2_bml);
+
+  bml_deallocate(&x2_bml);
+  bml_deallocate(&t_bml);
+}
+
+/// \details
+/// Fourth order trace resetting purification (TRS4, Niklasson).
+///
+/// With F(X) = X^2 (4X - 3X^2) and G(X) = X^2 (I - X)^2 each step is
+/// X = F + gamma * G, where gamma = (nocc - Tr(F)) / Tr(G) resets the
+/// trace to nocc. Tr(F) and Tr(G) follow from Tr(X^3) = Tr(X X^2) and
+/// Tr(X^4) = Tr(X^2 X^2), so the update costs one more multiply:
+///
+/// X = X^2 (gamma * I + (4 - 2 gamma) X + (gamma - 3) X^2)
+///
+/// For gamma outside [0,6] the polynomial is not monotone on [0,1] and
+/// the matching SP2 step is taken instead. The loop stops when the
+/// idempotency error Tr(X) - Tr(X^2) falls below idemTol, or when it
+/// has not reached a new minimum for PURIFY_STALL steps in a row;
+/// minIter is not used, since one step here does the work of several
+/// SP2 steps. The multiplies are reported next to the iterations.
+void trs4Loop(const bml_matrix_t* h_bml,
+              bml_matrix_t* rho_bml,
+              const real_t nocc,
+              const int maxsp2iter,
+              const real_t idemTol,
+              const real_t threshold)
+{
+  startTimer(sp2LoopTimer);
+
+  // Same normalization as SP2
+  startTimer(normTimer);
+  bml_copy(h_bml, rho_bml);
+  normalize(rho_bml, nocc, threshold);
+  stopTimer(normTimer);
+
+  bml_matrix_t* x_bml = rho_bml;
+  bml_matrix_t* x2_bml = bml_copy_new(rho_bml);
+  bml_matrix_t* t_bml = bml_copy_new(rho_bml);
+
+  real_t idempErr = ZERO;
+  real_t idempErrMin = ZERO;
+  int nstall = 0;
+
+  int iter = 0;
+  int nmult = 0;
+
+  if (bml_printRank() && debug_i == 1)
+    printf("\nTRS4Loop:\n");
+
+  while (iter < maxsp2iter)
+  {
+    // X^2 with the traces of X and X^2, then Tr(X^3) and Tr(X^4)
+    startTimer(x2Timer);
+    real_t* trace = bml_multiply_x2(x_bml, x2_bml, threshold);
+    real_t trX = trace[0];
+    real_t trX2 = trace[1];
+    bml_free_memory(trace);
+    real_t trX3 = bml_trace_mult(x_bml, x2_bml);
+    real_t trX4 = bml_trace_mult(x2_bml, x2_bml);
+    stopTimer(x2Timer);
+
+#ifdef DO_MPI
+    if (bml_getNRanks() > 1)
+    {
+      startTimer(reduceCommTimer);
+      real_t sendBuf[4] = {trX, trX2, trX3, trX4};
+      real_t recvBuf[4];
+      addRealParallel(sendBuf, recvBuf, 4);
+      trX = recvBuf[0];
+      trX2 = recvBuf[1];
+      trX3 = recvBuf[2];
+      trX4 = recvBuf[3];
+      stopTimer(reduceCommTimer);
+      collectCounter(reduceCounter, 4 * sizeof(real_t));
+    }
+#endif
+
+    idempErr = ABS(trX - trX2);
+    nmult++;
+
+    if (bml_printRank() && debug_i == 1)
+      printf("iter = %d  trX = %e  trX2 = %e  idempErr = %e\n", 
+        iter, trX, trX2, idempErr);
+
+    // Stop once converged, or after PURIFY_STALL steps in a row
+    // without a new smallest error (single noisy steps do not count)
+    if (iter == 0 || idempErr < idempErrMin)
+    {
+      idempErrMin = idempErr;
+      nstall = 0;
+    }
+    else if (iter >= 2)
+      nstall++;
+    if (idempErr < idemTol || nstall >= PURIFY_STALL)
+      break;
+
+    real_t trF = 4.0 * trX3 - 3.0 * trX4;
+    real_t trG = trX2 - TWO * trX3 + trX4;
+    if (trG <= ZERO) break;
+    real_t gamma = (nocc - trF) / trG;
+
+    if (gamma > 6.0)
+    {
+      // X = 2 * X - X^2
+      startTimer(xaddTimer);
+      bml_add(x_bml, x2_bml, TWO, MINUS_ONE, threshold);
+      stopTimer(xaddTimer);
+    }
+    else if (gamma < ZERO)
+    {
+      // X = X^2, swap buffers
+      bml_matrix_t* tmp_bml = x_bml;
+      x_bml = x2_bml;
+      x2_bml = tmp_bml;
+    }
+    else
+    {
+      // X = X^2 (gamma * I + (4 - 2 gamma) X + (gamma - 3) X^2)
+      startTimer(xaddTimer);
+      bml_add(x_bml, x2_bml, 4.0 - TWO * gamma, gamma - 3.0, threshold);
+      bml_add_identity(x_bml, gamma, threshold);
+      stopTimer(xaddTimer);
+
+      startTimer(mmTimer);
+      bml_multiply(x2_bml, x_bml, t_bml, ONE, ZERO, threshold);
+      stopTimer(mmTimer);
+      nmult++;
+
+      bml_matrix_t* tmp_bml = x_bml;
+      x_bml = t_bml;
+      t_bml = tmp_bml;
+    }
+
+    iter++;
+  }
+
+  stopTimer(sp2LoopTimer);
+
+  if (bml_printRank())
+  {
+    printf("Final idempotency error |Tr(X) - Tr(X^2)| = %e\n", idempErr);
+    printf("Purification: %d iterations, %d multiplies\n", iter, nmult);
+  }
+
+  finishPurify(iter, rho_bml, x_bml, x2_bml, t_bml);
+}
+
+/// \details
+/// Canonical purification (Palser and Manolopoulos).
+///
+/// The initial guess keeps the trace at nocc from the start,
+///
+/// X0 = lambda (mu I - H) + theta I,  theta = nocc / N,  mu = Tr(H) / N
+///
+/// with lambda the largest value that keeps the spectrum of X0 in [0,1].
+/// Each step uses c = Tr(X^2 - X^3) / Tr(X - X^2):
+///
+/// c >= 1/2:  X = ((1 + c) X^2 - X^3) / c
+/// c <  1/2:  X = ((1 - 2c) X + (1 + c) X^2 - X^3) / (1 - c)
+///
+/// which preserves the trace, so no branch decisions are needed. The
+/// stopping rule is the one used by trs4Loop.
+void canonicalLoop(const bml_matrix_t* h_bml,
+                   bml_matrix_t* rho_bml,
+                   const real_t nocc,
+                   const int maxsp2iter,
+                   const real_t idemTol,
+                   const real_t threshold)
+{
+  int N = bml_get_N(h_bml);
+
+  startTimer(sp2LoopTimer);
+
+  startTimer(normTimer);
+  real_t* gbnd = spectralBounds(h_bml, nocc, threshold);
+  real_t hmu = bml_trace(h_bml) / N;
+  real_t theta = nocc / N;
+  real_t lambda = MIN(theta / (gbnd[1] - hmu), (ONE - theta) / (hmu - gbnd[0]));
+  bml_free_memory(gbnd);
+
+  bml_copy(h_bml, rho_bml);
+  bml_scale_add_identity(rho_bml, -lambda, lambda * hmu + theta, ZERO);
+  stopTimer(normTimer);
+
+  bml_matrix_t* x_bml = rho_bml;
+  bml_matrix_t* x2_bml = bml_copy_new(rho_bml);
+  bml_matrix_t* t_bml = bml_copy_new(rho_bml);
+
+  real_t idempErr = ZERO;
+  real_t idempErrMin = ZERO;
+  int nstall = 0;
+
+  int iter = 0;
+  int nmult = 0;
+
+  if (bml_printRank() && debug_i == 1)
+    printf("\nCanonicalLoop:\n");
+
+  while (iter < maxsp2iter)
+  {
+    // X^2 with the traces of X and X^2, then Tr(X^3)
+    startTimer(x2Timer);
+    real_t* trace = bml_multiply_x2(x_bml, x2_bml, threshold);
+    real_t trX = trace[0];
+    real_t trX2 = trace[1];
+    bml_free_memory(trace);
+    real_t trX3 = bml_trace_mult(x_bml, x2_bml);
+    stopTimer(x2Timer);
+
+#ifdef DO_MPI
+    if (bml_getNRanks() > 1)
+    {
+      startTimer(reduceCommTimer);
+      real_t sendBuf[3] = {trX, trX2, trX3};
+      real_t recvBuf[3];
+      addRealParallel(sendBuf, recvBuf, 3);
+      trX = recvBuf[0];
+      trX2 = recvBuf[1];
+      trX3 = recvBuf[2];
+      stopTimer(reduceCommTimer);
+      collectCounter(reduceCounter, 3 * sizeof(real_t));
+    }
+#endif
+
+    idempErr = ABS(trX - trX2);
+    nmult++;
+
+    if (bml_printRank() && debug_i == 1)
+      printf("iter = %d  trX = %e  trX2 = %e  idempErr = %e\n", 
+        iter, trX, trX2, idempErr);
+
+    // Stop once converged, or after PURIFY_STALL steps in a row
+    // without a new smallest error (single noisy steps do not count)
+    if (iter == 0 || idempErr < idempErrMin)
+    {
+      idempErrMin = idempErr;
+      nstall = 0;
+    }
+    else if (iter >= 2)
+      nstall++;
+    if (idempErr < idemTol || nstall >= PURIFY_STALL)
+      break;
+
+    real_t c = (trX2 - trX3) / (trX - trX2);
+    if (c < ZERO || c > ONE) break;
+
+    // X^3
+    startTimer(mmTimer);
+    bml_multiply(x_bml, x2_bml, t_bml, ONE, ZERO, threshold);
+    stopTimer(mmTimer);
+    nmult++;
+
+    startTimer(xaddTimer);
+    if (c >= HALF)
+    {
+      // X = ((1 + c) X^2 - X^3) / c, built in the X^2 buffer
+      bml_add(x2_bml, t_bml, (ONE + c) / c, MINUS_ONE / c, threshold);
+      bml_matrix_t* tmp_bml = x_bml;
+      x_bml = x2_bml;
+      x2_bml = tmp_bml;
+    }
+    else
+    {
+      // X = ((1 - 2c) X + (1 + c) X^2 - X^3) / (1 - c)
+      bml_add(x_bml, x2_bml, (ONE - TWO * c) / (ONE - c), 
+        (ONE + c) / (ONE - c), threshold);
+      bml_add(x_bml, t_bml, ONE, MINUS_ONE / (ONE - c), threshold);
+    }
+    stopTimer(xaddTimer);
+
+    iter++;
+  }
+
+  stopTimer(sp2LoopTimer);
+
+  if (bml_printRank())
+  {
+    printf("Final idempotency error |Tr(X) - Tr(X^2)| = %e\n", idempErr);
+    printf("Purification: %d iterations, %d multiplies\n", iter, nmult);
+  }
+
+  finishPurify(iter, rho_bml, x_bml, x2_bml, t_bml);
 }
 
 /// \details
@@ -10,15 +10,62 @@
 
 #include "mytype.h"
 
-void normalize(bml_matrix_t* h_bml);
-
-void sp2Loop(const bml_matrix_t* h_bml, 
-             bml_matrix_t* rho_bml, 
-             const real_t nocc, 
-             const int minsp2iter, 
-             const int maxsp2iter, 
-             const real_t idemTol,
-             const real_t threshold);
+/// Branch sequence and bounds recorded from one SP2 solve, to be
+/// replayed on the next (slightly different) H.
+typedef struct Sp2SequenceSt
+{
+  int nsteps;          //!< number of recorded steps
+  int* branch;         //!< branch of each step (1: X = 2X - X^2, -1: X = X^2)
+  real_t emin;         //!< lower bound used for normalization
+  real_t emax;         //!< upper bound used for normalization
+  real_t idempErr;     //!< final idempotency error of the recorded solve
+} Sp2Sequence;
+
+void normalize(bml_matrix_t* h_bml,
+               const real_t nocc,
+               const real_t threshold);
+
+void normalizeBounds(bml_matrix_t* h_bml,
+                     const real_t emin,
+                     const real_t emax);
+
+int sp2Step(bml_matrix_t** x_bml,
+            bml_matrix_t** x2_bml,
+            const real_t nocc,
+            const real_t idemTol,
+            const real_t threshold,
+            real_t* trX,
+            real_t* trX2);
+
+int sp2Loop(const bml_matrix_t* h_bml, 
+            bml_matrix_t* rho_bml, 
+            const real_t nocc, 
+            const int minsp2iter, 
+            const int maxsp2iter, 
+            const real_t idemTol,
+            const real_t threshold,
+            Sp2Sequence* seq);
+
+int sp2Replay(const bml_matrix_t* h_bml,
+              bml_matrix_t* rho_bml,
+              const real_t nocc,
+              const Sp2Sequence* seq,
+              const real_t idemTol,
+              const real_t threshold);
+
+void trs4Loop(const bml_matrix_t* h_bml,
+              bml_matrix_t* rho_bml,
+              const real_t nocc,
+              const int maxsp2iter,
+              const real_t idemTol,
+              const real_t threshold);
+
+void canonicalLoop(const bml_matrix_t* h_bml,
+                   bml_matrix_t* rho_bml,
+                   const real_t nocc,
+                   const int maxsp2iter,
+                   const real_t idemTol,
+                   const real_t threshold);
 
 void reportResults(const int iter,
                    const bml_matrix_t* rho_bml, 
@@ -0,0 +1,419 @@
+/// \file
+/// Chebyshev kernel polynomial loop.
+///
+/// The density matrix X = f(H), with f the Fermi-Dirac function
+/// 1/(1 + exp(beta*(e - mu))), is expanded in Chebyshev polynomials of
+/// Hs = (H - center*I)/halfWidth, which has its spectrum in [-1,1].
+/// The coefficients are damped with the Jackson kernel, as in the
+/// kernel polynomial method. The degree needed only depends on
+/// beta*halfWidth, not on the HOMO-LUMO gap.
+///
+/// The series is evaluated Paterson-Stockmeyer style. With block size
+/// s ~ sqrt(n) it is rewritten as
+///
+///   p(Hs) = sum_j R_j(Hs) T_js(Hs),  R_j = sum_{r<s} r_jr T_r(Hs)
+///
+/// Since T_js = T_j(T_s), the outer sum is a Chebyshev series in T_s
+/// with matrix coefficients and is summed by the Clenshaw recurrence.
+/// Forming T_1..T_s costs s-1 multiplies and the outer sum n/s. The
+/// R_j are combinations of the stored T_r and only cost additions.
+/// Finding mu for the occupation takes another n/s multiplies (see
+/// chebyshevLoop), about 3*sqrt(n) in all instead of the n of the
+/// three-term recurrence.
+
+#ifdef SP2_CHEBYSHEV
+
+#include "bml.h"
+
+#include "sp2Chebyshev.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "performance.h"
+#include "parallel.h"
+#include "constants.h"
+#include "stochasticTrace.h"
+#include "lanczos.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/// Degree per unit of beta*halfWidth for the automatic degree
+#define CHEB_DEGREE_FACTOR 6.0
+/// Smallest automatic degree
+#define CHEB_MIN_DEGREE 16
+
+/// \details
+/// Normalize a Hamiltonian matrix prior to the Chebyshev expansion.
+///
+/// Hs = (H - center*I) / halfWidth
+///
+/// with center and halfWidth from the spectral bounds emin and emax,
+/// so that the spectrum of Hs lies in [-1,1].
+void normalize(bml_matrix_t* h_bml,
+               const real_t emin,
+               const real_t emax)
+{
+  real_t halfWidthInverse = TWO / (emax - emin);
+  real_t center = HALF * (emax + emin);
+
+  bml_scale_add_identity(h_bml, halfWidthInverse, -center * halfWidthInverse,
+    ZERO);
+}
+
+/// \details
+/// Fermi-Dirac occupation of a state at energy e.
+static real_t fermi(const real_t e,
+                    const real_t mu,
+                    const real_t beta)
+{
+  return ONE / (ONE + exp(beta * (e - mu)));
+}
+
+/// \details
+/// Polynomial degree for inverse temperature beta, for use when
+/// chebDegree is not given. The Fermi function varies on the scale
+/// 1/(beta*halfWidth) of the normalized spectrum and the Chebyshev
+/// series resolves features down to about pi/degree, so the degree
+/// grows linearly with beta*halfWidth. nocc and threshold are passed to
+/// spectralBounds.
+int chebyshevDegree(const bml_matrix_t* h_bml,
+                    const real_t nocc,
+                    const real_t beta,
+                    const real_t threshold)
+{
+  if (beta <= ZERO)
+  {
+    printf("Chebyshev expansion needs beta > 0 (--beta)\n");
+    exit(1);
+  }
+
+  real_t* bnd = spectralBounds(h_bml, nocc, threshold);
+  real_t halfWidth = HALF * (bnd[1] - bnd[0]);
+  bml_free_memory(bnd);
+
+  int degree = (int) ceil(CHEB_DEGREE_FACTOR * beta * halfWidth);
+
+  return MAX(degree, CHEB_MIN_DEGREE);
+}
+
+/// \details
+/// Chebyshev coefficients c_0..c_n of the Fermi function on the
+/// normalized spectrum, from Chebyshev-Gauss quadrature on 2(n+1)
+/// nodes, optionally damped with the Jackson kernel (kernel = 1).
+static void chebyshevCoefficients(const int degree,
+                                  const real_t mu,
+                                  const real_t beta,
+                                  const real_t center,
+                                  const real_t halfWidth,
+                                  const int kernel,
+                                  real_t* coef)
+{
+  int nnodes = 2 * (degree + 1);
+
+  for (int k = 0; k <= degree; k++)
+    coef[k] = ZERO;
+
+  for (int j = 0; j < nnodes; j++)
+  {
+    real_t theta = M_PI * (j + HALF) / nnodes;
+    real_t f = fermi(center + halfWidth * cos(theta), mu, beta);
+    for (int k = 0; k <= degree; k++)
+      coef[k] += f * cos(k * theta);
+  }
+
+  for (int k = 0; k <= degree; k++)
+  {
+    coef[k] *= ((k == 0) ? ONE : TWO) / nnodes;
+    if (kernel == 1) coef[k] *= jacksonKernel(k, degree + 1);
+  }
+}
+
+/// \details
+/// Split sum_k c_k T_k into blocks sum_j R_j T_js with R_j of degree
+/// below s, using T_js+r = 2 T_js T_r - T_js-r. The coefficient of
+/// T_r in R_j is r[j*s + r]. Each c_k only passes along a chain of
+/// terms of size 2|c_k|, so the split does not amplify errors.
+static void blockCoefficients(const int degree,
+                              const int s,
+                              const real_t* coef,
+                              real_t* r)
+{
+  int m = degree / s;
+  real_t* c = malloc((degree + 1) * sizeof(real_t));
+
+  for (int k = 0; k <= degree; k++)
+    c[k] = coef[k];
+  for (int k = 0; k < (m + 1) * s; k++)
+    r[k] = ZERO;
+
+  for (int k = degree; k >= 0; k--)
+  {
+    int j = k / s;
+    int rem = k % s;
+
+    if (j == 0 || rem == 0)
+    {
+      r[j*s + rem] += c[k];
+    }
+    else
+    {
+      r[j*s + rem] += TWO * c[k];
+      c[j*s - rem] -= c[k];
+    }
+  }
+
+  free(c);
+}
+
+/// \details
+/// a = sum_r r[rem] T_r for r < s, from the stored t_bml[1..s-1].
+static void blockPolynomial(bml_matrix_t** t_bml,
+                            const real_t* r,
+                            const int s,
+                            bml_matrix_t* a_bml,
+                            const real_t threshold)
+{
+  startTimer(xaddTimer);
+  bml_copy(t_bml[1], a_bml);
+  bml_scale_inplace((void*) &r[1], a_bml);
+  for (int k = 2; k < s; k++)
+    bml_add(a_bml, t_bml[k], ONE, r[k], threshold);
+  bml_add_identity(a_bml, r[0], threshold);
+  stopTimer(xaddTimer);
+}
+
+/// \details
+/// Chebyshev expansion of the Fermi function of h_bml at inverse
+/// temperature beta. mu is set so that the trace of the expansion is
+/// nocc, from the exact moments Tr(T_k(Hs)) of H.
+///
+/// The moments come from the same matrices: the outer recurrence
+/// U_j+1 = 2 T_s U_j - U_j-1 gives U_j = T_js, and with
+/// T_js+r = 2 T_js T_r - T_js-r the others are traces of products,
+/// which need no multiplies. This costs n/s more multiplies but puts
+/// the occupation right without a second pass.
+void chebyshevLoop(const bml_matrix_t* h_bml,
+                   bml_matrix_t* rho_bml,
+                   const real_t nocc,
+                   real_t* mu,
+                   const real_t beta,
+                   const int degree,
+                   const int kernel,
+                   const real_t threshold)
+{
+  int N = bml_get_N(h_bml);
+  int M = bml_get_M(h_bml);
+  bml_matrix_type_t matrix_type = bml_get_type(h_bml);
+  bml_matrix_precision_t precision = bml_get_precision(h_bml);
+  bml_distribution_mode_t dmode = bml_get_distribution_mode(h_bml);
+
+  int nmult = 0;
+  int s = MAX((int) ceil(sqrt((real_t) (degree + 1))), 2);
+  int m = degree / s;
+
+  real_t* bnd = spectralBounds(h_bml, nocc, threshold);
+  real_t emin = bnd[0];
+  real_t emax = bnd[1];
+  real_t center = HALF * (emin + emax);
+  real_t halfWidth = HALF * (emax - emin);
+  bml_free_memory(bnd);
+
+  // T_1 = Hs
+  bml_matrix_t** t_bml = malloc((s + 1) * sizeof(bml_matrix_t*));
+  t_bml[0] = NULL;
+  startTimer(copyTimer);
+  t_bml[1] = bml_copy_new(h_bml);
+  stopTimer(copyTimer);
+  startTimer(normTimer);
+  normalize(t_bml[1], emin, emax);
+  stopTimer(normTimer);
+
+  // T_k+1 = 2 Hs T_k - T_k-1, up to the giant step T_s
+  for (int k = 1; k < s; k++)
+  {
+    t_bml[k+1] = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+    startTimer(mmTimer);
+    if (k == 1)
+    {
+      bml_multiply(t_bml[1], t_bml[1], t_bml[2], TWO, ZERO, threshold);
+      bml_add_identity(t_bml[2], MINUS_ONE, threshold);
+    }
+    else
+    {
+      bml_copy(t_bml[k-1], t_bml[k+1]);
+      bml_multiply(t_bml[1], t_bml[k], t_bml[k+1], TWO, MINUS_ONE, threshold);
+    }
+    stopTimer(mmTimer);
+    nmult++;
+  }
+
+  bml_matrix_t* b1_bml = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+  bml_matrix_t* b2_bml = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+  bml_matrix_t* x2_bml = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+
+  // Moments, with U_j in u_bml and U_j-1 in uOld_bml
+  real_t* moment = malloc((degree + 1) * sizeof(real_t));
+  moment[0] = N;
+  for (int k = 1; k <= MIN(s, degree); k++)
+    moment[k] = bml_trace(t_bml[k]);
+
+  bml_matrix_t* uOld_bml = NULL;
+  bml_matrix_t* u_bml = t_bml[s];
+  for (int j = 1; j <= m; j++)
+  {
+    if (j > 1)
+    {
+      bml_matrix_t* next_bml = (u_bml == b1_bml) ? b2_bml : b1_bml;
+      startTimer(mmTimer);
+      if (j == 2)
+      {
+        bml_multiply(u_bml, u_bml, next_bml, TWO, ZERO, threshold);
+        bml_add_identity(next_bml, MINUS_ONE, threshold);
+      }
+      else
+      {
+        if (uOld_bml != next_bml) bml_copy(uOld_bml, next_bml);
+        bml_multiply(t_bml[s], u_bml, next_bml, TWO, MINUS_ONE, threshold);
+      }
+      stopTimer(mmTimer);
+      nmult++;
+      uOld_bml = u_bml;
+      u_bml = next_bml;
+      moment[j*s] = bml_trace(u_bml);
+    }
+
+    for (int rem = 1; rem < s && j*s + rem <= degree; rem++)
+      moment[j*s + rem] = TWO * bml_trace_mult(u_bml, t_bml[rem]) - 
+        moment[j*s - rem];
+  }
+
+  // The trace of the expansion is sum_k c_k(mu)*moment_k. The same sum
+  // over the quadrature nodes of the coefficients, sum_j w_j*f(e_j),
+  // has weights w_j independent of mu.
+  int nnodes = 2 * (degree + 1);
+  real_t* energy = malloc(nnodes * sizeof(real_t));
+  real_t* weight = malloc(nnodes * sizeof(real_t));
+  for (int j = 0; j < nnodes; j++)
+  {
+    real_t theta = M_PI * (j + HALF) / nnodes;
+    real_t w = moment[0];
+    for (int k = 1; k <= degree; k++)
+    {
+      real_t g = (kernel == 1) ? jacksonKernel(k, degree + 1) : ONE;
+      w += TWO * g * moment[k] * cos(k * theta);
+    }
+    energy[j] = center + halfWidth * cos(theta);
+    weight[j] = w / nnodes;
+  }
+
+  // Bisection on the occupation, which increases with mu
+  real_t muLow = emin;
+  real_t muHigh = emax;
+  real_t occ = ZERO;
+  for (int iter = 0; iter < 100 && muHigh - muLow > 1.0E-12; iter++)
+  {
+    *mu = HALF * (muLow + muHigh);
+    occ = ZERO;
+    for (int j = 0; j < nnodes; j++)
+      occ += weight[j] * fermi(energy[j], *mu, beta);
+
+    if (occ < nocc)
+      muLow = *mu;
+    else
+      muHigh = *mu;
+  }
+
+  real_t* coef = malloc((degree + 1) * sizeof(real_t));
+  real_t* r = malloc((m + 1) * s * sizeof(real_t));
+  chebyshevCoefficients(degree, *mu, beta, center, halfWidth, kernel, coef);
+  blockCoefficients(degree, s, coef, r);
+
+  // Clenshaw in T_s: b_j = R_j + 2 T_s b_j+1 - b_j+2, with b_m = R_m
+  if (m == 0)
+  {
+    blockPolynomial(t_bml, &r[0], s, rho_bml, threshold);
+  }
+  else
+  {
+    real_t zero = ZERO;
+    bml_scale_inplace(&zero, b2_bml);
+    blockPolynomial(t_bml, &r[m*s], s, b1_bml, threshold);
+    for (int j = m - 1; j >= 0; j--)
+    {
+      // Last step p = R_0 + T_s b_1 - b_2
+      real_t alpha = (j > 0) ? TWO : ONE;
+      startTimer(mmTimer);
+      bml_multiply(t_bml[s], b1_bml, b2_bml, alpha, MINUS_ONE, threshold);
+      stopTimer(mmTimer);
+      nmult++;
+
+      blockPolynomial(t_bml, &r[j*s], s, x2_bml, threshold);
+      startTimer(xaddTimer);
+      bml_add(b2_bml, x2_bml, ONE, ONE, threshold);
+      stopTimer(xaddTimer);
+
+      bml_matrix_t* swap = b1_bml;
+      b1_bml = b2_bml;
+      b2_bml = swap;
+    }
+    startTimer(copyTimer);
+    bml_copy(b1_bml, rho_bml);
+    stopTimer(copyTimer);
+  }
+
+  if (bml_printRank())
+  {
+    printf("Chebyshev degree = %d  block size = %d\n", degree, s);
+    printf("Occupation of the expansion = %lg (nocc = %lg)\n", occ, nocc);
+  }
+
+  // X = 2*X
+  bml_scale_inplace(&TWO, rho_bml);
+
+  // There is no X^2 here, x2_bml is Clenshaw scratch
+  reportResults(nmult, rho_bml, NULL);
+
+  for (int k = 1; k <= s; k++)
+    bml_deallocate(&t_bml[k]);
+  free(t_bml);
+  bml_deallocate(&b1_bml);
+  bml_deallocate(&b2_bml);
+  bml_deallocate(&x2_bml);
+  free(moment);
+  free(energy);
+  free(weight);
+  free(coef);
+  free(r);
+}
+
+/// \details
+/// Report density matrix results. x2_bml may be NULL, in which case
+/// the X2 sparsity is not reported.
+void reportResults(const int iter,
+                   const bml_matrix_t* rho_bml,
+                   const bml_matrix_t* x2_bml)
+{
+  int sumIIA = 0;
+  int sumIIC = 0;
+  int maxIIA = bml_get_bandwidth(rho_bml);
+  int maxIIC = (x2_bml != NULL) ? bml_get_bandwidth(x2_bml) : 0;
+
+  if (bml_printRank())
+  {
+    printf("\nResults:\n");
+    if (x2_bml != NULL)
+      printf("X2 Sparsity CCN = %d, fraction = %e avg = %g, max = %d\n", sumIIC,
+        (real_t)sumIIC/(real_t)(N_i*N_i), (real_t)sumIIC/(real_t)N_i, maxIIC);
+
+    printf("RHO Sparsity AAN = %d, fraction = %e avg = %g, max = %d\n", sumIIA,
+      (real_t)sumIIA/(real_t)(N_i*N_i), (real_t)sumIIA/(real_t)N_i, maxIIA);
+
+    printf("Number of matrix multiplies = %d\n", iter);
+  }
+}
+
+#endif
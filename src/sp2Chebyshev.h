@@ -0,0 +1,35 @@
+/// \file
+/// Chebyshev kernel polynomial functions.
+
+#ifndef __SP2CHEBYSHEV_H
+#define __SP2CHEBYSHEV_H
+
+#include "bml.h"
+
+#include <stdio.h>
+
+#include "mytype.h"
+
+void normalize(bml_matrix_t* h_bml,
+               const real_t emin,
+               const real_t emax);
+
+int chebyshevDegree(const bml_matrix_t* h_bml,
+                    const real_t nocc,
+                    const real_t beta,
+                    const real_t threshold);
+
+void chebyshevLoop(const bml_matrix_t* h_bml,
+                   bml_matrix_t* rho_bml,
+                   const real_t nocc,
+                   real_t* mu,
+                   const real_t beta,
+                   const int degree,
+                   const int kernel,
+                   const real_t threshold);
+
+void reportResults(const int iter,
+                   const bml_matrix_t* rho_bml,
+                   const bml_matrix_t* x2_bml);
+
+#endif
@@ -0,0 +1,242 @@
+/// \file
+/// Diagonalization reference solver.
+///
+/// The density matrix is formed from the eigendecomposition
+/// H = V*diag(e)*V^T as P = V*diag(2*f(e))*V^T, with f the Fermi-Dirac
+/// occupation for beta > 0, or the lowest nocc states filled at zero
+/// temperature. bml_diagonalize calls the LAPACK symmetric eigensolver
+/// for dense matrices. The cost is O(N^3) regardless of sparsity and
+/// gap, which for small or dense H can beat 25-30 SP2 multiplies, and
+/// the result is exact to rounding, so it also serves as the accuracy
+/// reference for the other solvers (see diagReference, which is built
+/// with every solver).
+
+#include "bml.h"
+
+#include "sp2Diag.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "performance.h"
+#include "parallel.h"
+#include "constants.h"
+
+#ifdef SP2_DIAG
+
+/// Size of the dense sample diagonalized by the benchmark
+#define DIAG_BENCH_N 256
+/// SP2 iterations assumed by the benchmark
+#define DIAG_SP2_ITER 30
+/// Relative distance below which eigenvalues count as degenerate
+#define DIAG_TIE_TOL 1.0E-10
+
+/// \details
+/// Ascending order for qsort.
+static int compareReal(const void* a,
+                       const void* b)
+{
+  real_t x = *(const real_t*) a;
+  real_t y = *(const real_t*) b;
+
+  return (x > y) - (x < y);
+}
+
+/// \details
+/// Pick DIAG (returns 1) or SP2 (returns 0). mode 1 and 2 force DIAG
+/// and SP2. With mode 0 a quick benchmark decides: one multiply with H
+/// itself, so its fill fraction is accounted for, gives the cost of an
+/// SP2 iteration, while a dense DIAG_BENCH_N sample is diagonalized
+/// and multiplied, and scaled by (N/DIAG_BENCH_N)^3.
+int diagSelect(const bml_matrix_t* h_bml,
+               const int mode,
+               const real_t threshold)
+{
+  if (mode == 1) return 1;
+  if (mode == 2) return 0;
+
+  int N = bml_get_N(h_bml);
+  int M = bml_get_M(h_bml);
+  bml_matrix_type_t matrix_type = bml_get_type(h_bml);
+  bml_matrix_precision_t precision = bml_get_precision(h_bml);
+  bml_distribution_mode_t dmode = bml_get_distribution_mode(h_bml);
+
+  // Lap times, see getElapsedTime
+  getElapsedTime(benchTimer);
+
+  // One SP2-like multiply
+  bml_matrix_t* x2_bml = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+  startTimer(benchTimer);
+  bml_multiply(h_bml, h_bml, x2_bml, ONE, ZERO, threshold);
+  stopTimer(benchTimer);
+  real_t multCost = getElapsedTime(benchTimer);
+  bml_deallocate(&x2_bml);
+
+  // Dense sample: diagonalization and the two multiplies forming P
+  int n0 = MIN(N, DIAG_BENCH_N);
+  bml_matrix_t* a_bml = bml_banded_matrix(matrix_type, precision, n0, n0, dmode);
+  bml_matrix_t* v_bml = bml_zero_matrix(matrix_type, precision, n0, n0, dmode);
+  bml_matrix_t* t_bml = bml_zero_matrix(matrix_type, precision, n0, n0, dmode);
+  real_t* eval = bml_allocate_memory(n0 * sizeof(real_t));
+  startTimer(benchTimer);
+  bml_diagonalize(a_bml, eval, v_bml);
+  bml_multiply(v_bml, v_bml, t_bml, ONE, ZERO, ZERO);
+  bml_multiply(t_bml, v_bml, a_bml, ONE, ZERO, ZERO);
+  stopTimer(benchTimer);
+  real_t scale = (real_t) N / n0;
+  real_t diagCost = getElapsedTime(benchTimer) * scale * scale * scale;
+  bml_free_memory(eval);
+  bml_deallocate(&a_bml);
+  bml_deallocate(&v_bml);
+  bml_deallocate(&t_bml);
+
+  real_t sp2Cost = DIAG_SP2_ITER * multCost;
+
+#ifdef DO_MPI
+  // All ranks must take the same branch
+  if (bml_getNRanks() > 1)
+  {
+    startTimer(reduceCommTimer);
+    maxRealReduce(&diagCost);
+    maxRealReduce(&sp2Cost);
+    stopTimer(reduceCommTimer);
+  }
+#endif
+
+  int useDiag = (diagCost < sp2Cost);
+
+  if (bml_printRank())
+    printf("Solver benchmark: DIAG ~ %lg s, SP2 ~ %lg s (%d x %lg s) -> %s\n",
+      diagCost, sp2Cost, DIAG_SP2_ITER, multCost, useDiag ? "DIAG" : "SP2");
+
+  return useDiag;
+}
+
+/// \details
+/// Density matrix by diagonalization. For beta > 0 mu is found by
+/// bisection so that the Fermi-Dirac occupations sum to nocc;
+/// otherwise the lowest nocc states are filled, the last one
+/// fractionally if nocc is not an integer.
+void diagLoop(const bml_matrix_t* h_bml,
+              bml_matrix_t* rho_bml,
+              const real_t nocc,
+              const real_t beta,
+              const real_t threshold)
+{
+  int N = bml_get_N(h_bml);
+  bml_matrix_type_t matrix_type = bml_get_type(h_bml);
+  bml_matrix_precision_t precision = bml_get_precision(h_bml);
+  bml_distribution_mode_t dmode = bml_get_distribution_mode(h_bml);
+
+  startTimer(diagTimer);
+
+  real_t* eval = bml_allocate_memory(N * sizeof(real_t));
+  bml_matrix_t* v_bml = bml_zero_matrix(matrix_type, precision, N, N, dmode);
+  bml_diagonalize((bml_matrix_t*) h_bml, eval, v_bml);
+
+  real_t* sorted = malloc(N * sizeof(real_t));
+  for (int i = 0; i < N; i++)
+    sorted[i] = eval[i];
+  qsort(sorted, N, sizeof(real_t), compareReal);
+
+  int homo = MIN(MAX((int) ceil(nocc) - 1, 0), N - 1);
+  int lumo = MIN(homo + 1, N - 1);
+  real_t mu = HALF * (sorted[homo] + sorted[lumo]);
+
+  // Occupations, times 2 for spin
+  real_t* occ = bml_allocate_memory(N * sizeof(real_t));
+  if (beta > ZERO)
+  {
+    real_t muLow = sorted[0] - 1.0;
+    real_t muHigh = sorted[N-1] + 1.0;
+    for (int iter = 0; iter < 200 && muHigh - muLow > 1.0E-14; iter++)
+    {
+      mu = HALF * (muLow + muHigh);
+      real_t sum = ZERO;
+      for (int i = 0; i < N; i++)
+        sum += ONE / (ONE + exp(beta * (eval[i] - mu)));
+      if (sum < nocc)
+        muLow = mu;
+      else
+        muHigh = mu;
+    }
+    for (int i = 0; i < N; i++)
+      occ[i] = TWO / (ONE + exp(beta * (eval[i] - mu)));
+  }
+  else
+  {
+    // Ties at the Fermi level share the fractional part. Degenerate
+    // eigenvalues are only equal to round-off, so ties are within
+    // DIAG_TIE_TOL of the spectral width.
+    real_t tol = DIAG_TIE_TOL * (sorted[N-1] - sorted[0]);
+    real_t below = ZERO;
+    int atLevel = 0;
+    for (int i = 0; i < N; i++)
+    {
+      if (eval[i] < sorted[homo] - tol) below += ONE;
+      else if (eval[i] <= sorted[homo] + tol) atLevel++;
+    }
+    real_t share = (nocc - below) / atLevel;
+    for (int i = 0; i < N; i++)
+    {
+      if (eval[i] < sorted[homo] - tol) occ[i] = TWO;
+      else if (eval[i] <= sorted[homo] + tol) occ[i] = TWO * share;
+      else occ[i] = ZERO;
+    }
+  }
+
+  // P = V * diag(occ) * V^T
+  bml_matrix_t* d_bml = bml_zero_matrix(matrix_type, precision, N, N, dmode);
+  bml_matrix_t* t_bml = bml_zero_matrix(matrix_type, precision, N, N, dmode);
+  bml_set_diagonal(d_bml, occ, ZERO);
+  bml_multiply(v_bml, d_bml, t_bml, ONE, ZERO, ZERO);
+  bml_transpose(v_bml);
+  bml_multiply(t_bml, v_bml, rho_bml, ONE, ZERO, threshold);
+
+  stopTimer(diagTimer);
+
+  if (bml_printRank())
+  {
+    printf("DIAG: mu = %lg  HOMO = %lg  LUMO = %lg  gap = %lg\n", mu,
+      sorted[homo], sorted[lumo], sorted[lumo] - sorted[homo]);
+    printf("Tr(P) = %lg\n", bml_trace(rho_bml));
+  }
+
+  bml_free_memory(eval);
+  bml_free_memory(occ);
+  free(sorted);
+  bml_deallocate(&v_bml);
+  bml_deallocate(&d_bml);
+  bml_deallocate(&t_bml);
+}
+
+#endif
+
+/// \details
+/// Compare rho_bml with the density matrix in refName, e.g. the
+/// dmatrix.out.mtx written by another solver with --dout 1.
+void diagReference(const bml_matrix_t* rho_bml,
+                   const char* refName)
+{
+  int N = bml_get_N(rho_bml);
+  int M = bml_get_M(rho_bml);
+  bml_matrix_type_t matrix_type = bml_get_type(rho_bml);
+  bml_matrix_precision_t precision = bml_get_precision(rho_bml);
+  bml_distribution_mode_t dmode = bml_get_distribution_mode(rho_bml);
+
+  bml_matrix_t* ref_bml = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+  bml_read_bml_matrix(ref_bml, refName);
+  real_t trRef = bml_trace(ref_bml);
+  real_t normRef = bml_fnorm(ref_bml);
+
+  bml_add(ref_bml, rho_bml, MINUS_ONE, ONE, ZERO);
+  real_t err = bml_fnorm(ref_bml);
+
+  if (bml_printRank())
+    printf("Reference %s: ||P - Pref||_F = %e (relative %e), "
+      "Tr(P) - Tr(Pref) = %e\n", refName, err, err / normRef, 
+      bml_trace(rho_bml) - trRef);
+
+  bml_deallocate(&ref_bml);
+}
@@ -0,0 +1,28 @@
+/// \file
+/// Diagonalization reference solver functions.
+
+#ifndef __SP2DIAG_H
+#define __SP2DIAG_H
+
+#include "bml.h"
+
+#include <stdio.h>
+
+#include "mytype.h"
+
+#ifdef SP2_DIAG
+int diagSelect(const bml_matrix_t* h_bml,
+               const int mode,
+               const real_t threshold);
+
+void diagLoop(const bml_matrix_t* h_bml,
+              bml_matrix_t* rho_bml,
+              const real_t nocc,
+              const real_t beta,
+              const real_t threshold);
+#endif
+
+void diagReference(const bml_matrix_t* rho_bml,
+                   const char* refName);
+
+#endif
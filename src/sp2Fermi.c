@@ -14,6 +14,9 @@
 #include "performance.h"
 #include "parallel.h"
 #include "constants.h"
+#include "matrixOps.h"
+#include "stochasticTrace.h"
+#include "lanczos.h"
 
 /// \details
 /// Normalize a Hamiltonian matrix prior to running the SP2 Fermi algorithm.
@@ -21,7 +24,11 @@
 /// X0 = ((hN-mu) * I - H) / (hN - h1)
 ///  or X0 = (hN*I-H0-mu*I)/(hN-h1)
 /// 
-/// where h1 and hN are scaled Gershgorin bounds.
+/// where h1 and hN are scaled spectral bounds (see spectralBounds).
+///
+/// normalize is affine in mu, so the solvers normalize H once at mu = 0
+/// and apply each new mu as the diagonal shift -mu/(hN - h1) * I. The
+/// first X0^2 of each mu follows from Xh^2 the same way (shiftedStart).
 ///
 void normalize(bml_matrix_t* h_bml, 
                const real_t h1, 
@@ -39,9 +46,541 @@ void normalize(bml_matrix_t* h_bml,
 
 }
 
+/// \details
+/// Starting chemical potential and normalization bounds from the
+/// spectral bounds bnd = {e1, eN}. mu starts at the center c of the
+/// bounds. X0 at that mu lies in [0,1] when [h1, hN] holds [e1, eN]
+/// shifted by c, and the normalized H at mu = 0 when it holds [e1, eN],
+/// so the bounds are widened by |c| on one side to hold both. h1 and hN
+/// are then scaled by tscale.
+static void fermiBounds(const real_t* bnd,
+                        const real_t tscale,
+                        real_t* mu,
+                        real_t* h1,
+                        real_t* hN)
+{
+  *mu = HALF * (bnd[1] + bnd[0]);
+  *h1 = tscale * MIN(bnd[0], bnd[0] + *mu);
+  *hN = tscale * MAX(bnd[1], bnd[1] + *mu);
+}
+
+/// \details
+/// Smallest number of SP2 Fermi steps that reaches inverse temperature
+/// beta, for use when nsteps is not given.
+///
+/// With the branch sequence steering the occupation, the orbit of the
+/// chemical potential stays near the 2-cycle x = (sqrt(5)-1)/2 of the
+/// maps x^2 and 2x-x^2, where both have slope sqrt(5)-1 = 1.236.
+/// After n steps the slope of X0 at mu is 1.236^n/(hN - h1), and
+/// matching the Fermi-Dirac slope beta/4 gives
+///
+///   beta_eff(n) = 4 * 1.236^n / (hN - h1)
+///
+/// where h1 and hN are the scaled spectral bounds, from spectralBounds
+/// with nocc and threshold. The mu search brings the occupation error
+/// within its limit at any n, so only beta sets the depth.
+int recursionDepth(const bml_matrix_t* h_bml,
+                   const real_t nocc,
+                   const real_t beta,
+                   const real_t tscale,
+                   const real_t threshold)
+{
+  if (beta <= ZERO)
+  {
+    printf("Automatic nsteps needs beta > 0 (--beta)\n");
+    exit(1);
+  }
+
+  real_t mu, h1, hN;
+  real_t* gbnd = spectralBounds(h_bml, nocc, threshold);
+  fermiBounds(gbnd, tscale, &mu, &h1, &hN);
+  real_t width = hN - h1;
+  bml_free_memory(gbnd);
+
+  real_t growth = sqrt(5.0) - ONE;
+  int nsteps = (int) ceil(log(beta * width / 4.0) / log(growth));
+
+  return MAX(nsteps, 1);
+}
+
+/// \details
+/// Exchange two matrix handles. Used in place of bml_copy when a
+/// recursion step replaces a matrix by a freshly computed one.
+static void swapMatrix(bml_matrix_t** a_bml, 
+                       bml_matrix_t** b_bml)
+{
+  bml_matrix_t* tmp_bml = *a_bml;
+  *a_bml = *b_bml;
+  *b_bml = tmp_bml;
+}
+
+/// \details
+/// Start the recursion at the shift s = mu/(hN - h1) from the
+/// normalized H at mu = 0, Xh, and its square Xh2:
+///
+///   X0 = Xh - s*I,  X0^2 = Xh^2 - 2s*Xh + s^2*I
+///
+/// This replaces the first X0^2 multiply of every mu update by an add.
+/// Returns Tr(X0) and Tr(X0^2).
+static void shiftedStart(const bml_matrix_t* xh_bml,
+                         const bml_matrix_t* xh2_bml,
+                         const real_t s,
+                         bml_matrix_t* x0_bml,
+                         bml_matrix_t* x2_bml,
+                         real_t* traceX0,
+                         real_t* traceX2,
+                         const real_t threshold)
+{
+  int N = bml_get_N(xh_bml);
+  real_t traceXh = bml_trace(xh_bml);
+
+  bml_copy(xh_bml, x0_bml);
+  bml_add_identity(x0_bml, -s, threshold);
+
+  bml_copy(xh2_bml, x2_bml);
+  bml_add(x2_bml, xh_bml, ONE, -TWO * s, threshold);
+  bml_add_identity(x2_bml, s * s, threshold);
+
+  *traceX0 = traceXh - s * N;
+  *traceX2 = bml_trace(xh2_bml) - TWO * s * traceXh + s * s * N;
+}
+
+/// Work matrices for one evaluation of the truncated SP2 recursion.
+typedef struct FermiWorkSt
+{
+  bml_matrix_t* x0_bml;   //!< X0, expansion of the Fermi function
+  bml_matrix_t* x1_bml;   //!< X1, derivative of X0 with respect to mu
+  bml_matrix_t* x2_bml;   //!< scratch for X0^2
+  bml_matrix_t* tmp_bml;  //!< scratch for X0*X1 + X1*X0
+  bml_matrix_t* t_bml;    //!< scratch for the transpose
+  real_t mu;              //!< chemical potential of this evaluation
+  real_t traceX0;         //!< Tr(X0) after the recursion
+  real_t traceX1;         //!< Tr(X1) after the recursion
+  int nmult;              //!< matrix multiplies performed
+} FermiWork;
+
+/// \details
+/// Allocate recursion work matrices shaped like h_bml. If x0_bml is
+/// given it is used as the X0 buffer, otherwise one is allocated.
+static void allocFermiWork(FermiWork* work,
+                           const bml_matrix_t* h_bml,
+                           bml_matrix_t* x0_bml)
+{
+  int N = bml_get_N(h_bml);
+  int M = bml_get_M(h_bml);
+  bml_matrix_type_t bml_type = bml_get_type(h_bml);
+  bml_matrix_precision_t precision = bml_get_precision(h_bml);
+  bml_distribution_mode_t dmode = bml_get_distribution_mode(h_bml);
+
+  if (x0_bml == NULL)
+    x0_bml = bml_zero_matrix(bml_type, precision, N, M, dmode);
+  work->x0_bml = x0_bml;
+  work->x1_bml = bml_zero_matrix(bml_type, precision, N, M, dmode);
+  work->x2_bml = bml_zero_matrix(bml_type, precision, N, M, dmode);
+  work->tmp_bml = bml_zero_matrix(bml_type, precision, N, M, dmode);
+  work->t_bml = bml_zero_matrix(bml_type, precision, N, M, dmode);
+  work->nmult = 0;
+}
+
+/// \details
+/// Deallocate recursion work matrices, except keep_bml which belongs
+/// to the caller.
+static void freeFermiWork(FermiWork* work,
+                          const bml_matrix_t* keep_bml)
+{
+  bml_matrix_t** handles[5] = { &work->x0_bml, &work->x1_bml, 
+    &work->x2_bml, &work->tmp_bml, &work->t_bml };
+
+  for (int i = 0; i < 5; i++)
+  {
+    if (*handles[i] != keep_bml)
+      bml_deallocate(handles[i]);
+  }
+}
+
+/// \details
+/// Run the truncated SP2 recursion for X0 and its mu derivative X1 at
+/// the chemical potential work->mu, starting from the normalized H.
+/// When firstTime is set the branch sequence is determined and stored
+/// in sgnlist, otherwise sgnlist is replayed.
+///
+/// The second derivative Y = d2X0/dmu2 would follow from the X1 update
+/// differentiated once more, Y = Y + sgnlist(i)*(Y - (X0*Y + Y*X0) -
+/// 2*X1^2), but that is two more multiplies per step. A pass carrying
+/// Y costs as much as the Newton pass its Halley step can save, so
+/// the mu search here stays Newton.
+static void fermiRecursion(FermiWork* work,
+                           const bml_matrix_t* xh_bml,
+                           const bml_matrix_t* xh2_bml,
+                           const bml_matrix_t* i_bml,
+                           const int nsteps,
+                           const real_t nocc,
+                           const real_t h1,
+                           const real_t hN,
+                           int* sgnlist,
+                           const int firstTime,
+                           const real_t threshold)
+{
+  real_t traceX0, traceX2;
+  real_t* trace;
+
+  // X0 = Xh - mu/(hN-h1) * I, and its square
+  startTimer(copyInitTimer);
+  shiftedStart(xh_bml, xh2_bml, work->mu / (hN - h1), work->x0_bml,
+    work->x2_bml, &traceX0, &traceX2, threshold);
+  stopTimer(copyInitTimer);
+
+  // X1 = -I/(hN-h1)
+  startTimer(copyInitTimer);
+  bml_copy(i_bml, work->x1_bml);
+  stopTimer(copyInitTimer);
+  real_t sfactor = MINUS_ONE / (hN - h1);
+  bml_scale_inplace(&sfactor, work->x1_bml);
+
+  for (int i = 0; i < nsteps; i++)
+  {
+    if (i > 0)
+    {
+      startTimer(x2InitTimer);
+      trace = bml_multiply_x2(work->x0_bml, work->x2_bml, threshold);
+      stopTimer(x2InitTimer);
+      work->nmult++;
+      traceX0 = trace[0];
+      traceX2 = trace[1];
+      bml_free_memory(trace);
+    }
+
+    // First time through determine sequence branching
+    if (firstTime == 1)
+    {
+      if (ABS(traceX2-nocc) < ABS(TWO * traceX0 - traceX2 - nocc))
+        sgnlist[i] = -1;
+      else
+        sgnlist[i] = 1;
+    }
+
+    // X1 = X1 + sgnlist(i)*(X1 - X0*X1 - X1*X0)
+    // if sgnlist == 1, X1 = 2 * X1 - (X0*X1 + X1*X0)
+    // if sgnlist == -1, X1 = X0*X1 + X1*X0
+    // 
+    // tmp = X0*X1 + X1*X0, one product since X0 and X1 are symmetric
+    startTimer(mmInitTimer);
+    anticommutator(work->x0_bml, work->x1_bml, work->tmp_bml, work->t_bml, 
+      threshold);
+    stopTimer(mmInitTimer);
+    work->nmult++;
+
+    if (sgnlist[i] == 1)
+    {
+      // X1 = 2 * X1 - tmp
+      startTimer(xaddInitTimer);
+      bml_add(work->x1_bml, work->tmp_bml, TWO, MINUS_ONE, threshold);
+      stopTimer(xaddInitTimer);
+    }
+    else
+    {
+      // X1 = tmp
+      swapMatrix(&work->x1_bml, &work->tmp_bml);
+    }
+
+    // X0 = X0 + sgnlist(i)*(X0 - X0_2)
+    // if sgnlist == 1, X0 = 2.0*X0 - X0_2
+    // if sgnlist == -1, X0 = X0_2
+    // 
+    if (sgnlist[i] == 1)
+    {
+      // X0 = 2 * X0 - X2
+      startTimer(xaddInitTimer);
+      bml_add(work->x0_bml, work->x2_bml, TWO, MINUS_ONE, threshold);
+      stopTimer(xaddInitTimer);
+    }
+    else
+    {
+      // X0 = X2
+      swapMatrix(&work->x0_bml, &work->x2_bml);
+    }
+  }
+
+  work->traceX0 = bml_trace(work->x0_bml);
+  work->traceX1 = bml_trace(work->x1_bml);
+}
+
+/// \details
+/// Step in mu to correct for occupation from the occupation error
+/// g = nocc - Tr(X0) and its derivatives d1 = Tr(DX), d2 = Tr(D2X).
+///
+/// With order 2 this is the Halley step 
+///
+///   lambda = 2*g*d1 / (2*d1^2 + g*d2)
+///
+/// which is cubically convergent, falling back to the Newton-Rhapson
+/// step g/d1 when the denominator is too small.
+static real_t occupationStep(const real_t g,
+                             const real_t d1,
+                             const real_t d2,
+                             const int order,
+                             const real_t traceLimit)
+{
+  if (order > 1)
+  {
+    real_t denom = TWO * d1 * d1 + g * d2;
+    if (ABS(denom) > traceLimit)
+      return TWO * g * d1 / denom;
+  }
+
+  if (ABS(d1) > traceLimit)
+    return g / d1;
+
+  return ZERO;
+}
+
+/// \details
+/// Newton-Rhapson step in mu to correct for occupation for a
+/// recursion evaluation.
+static real_t muStep(const FermiWork* work,
+                     const real_t nocc,
+                     const real_t traceLimit)
+{
+  return occupationStep(nocc - work->traceX0, work->traceX1, ZERO, 1,
+    traceLimit);
+}
+
+/// \details
+/// Scalar version of fermiRecursion on an estimated density of states.
+/// Every node carries the eigenvalue x of X0 and its mu derivative x1
+/// through the same SP2 steps, and the traces are the weighted sums.
+/// Costs O(nnodes*nsteps) flops instead of nsteps matrix squarings.
+static void densityRecursion(const SpectralDensity* dos,
+                             const real_t mu,
+                             const int nsteps,
+                             const real_t nocc,
+                             const real_t h1,
+                             const real_t hN,
+                             int* sgnlist,
+                             const int firstTime,
+                             real_t* traceX0,
+                             real_t* traceX1)
+{
+  int n = dos->nnodes;
+  real_t* x = bml_allocate_memory(n * sizeof(real_t));
+  real_t* x1 = bml_allocate_memory(n * sizeof(real_t));
+
+  for (int j = 0; j < n; j++)
+  {
+    x[j] = (hN - dos->energy[j] - mu) / (hN - h1);
+    x1[j] = MINUS_ONE / (hN - h1);
+  }
+
+  for (int i = 0; i < nsteps; i++)
+  {
+    if (firstTime == 1)
+    {
+      real_t tr0 = ZERO;
+      real_t tr2 = ZERO;
+      for (int j = 0; j < n; j++)
+      {
+        tr0 += dos->weight[j] * x[j];
+        tr2 += dos->weight[j] * x[j] * x[j];
+      }
+      if (ABS(tr2-nocc) < ABS(TWO * tr0 - tr2 - nocc))
+        sgnlist[i] = -1;
+      else
+        sgnlist[i] = 1;
+    }
+
+    for (int j = 0; j < n; j++)
+    {
+      if (sgnlist[i] == 1)
+      {
+        x1[j] = TWO * x1[j] - TWO * x[j] * x1[j];
+        x[j] = TWO * x[j] - x[j] * x[j];
+      }
+      else
+      {
+        x1[j] = TWO * x[j] * x1[j];
+        x[j] = x[j] * x[j];
+      }
+    }
+  }
+
+  *traceX0 = ZERO;
+  *traceX1 = ZERO;
+  for (int j = 0; j < n; j++)
+  {
+    *traceX0 += dos->weight[j] * x[j];
+    *traceX1 += dos->weight[j] * x1[j];
+  }
+
+  bml_free_memory(x);
+  bml_free_memory(x1);
+}
+
+/// \details
+/// Step in mu predicted by a stochastic density of states.
+///
+/// The density only models how the occupation changes with mu. Its
+/// stochastic and resolution errors are removed to first order by
+/// anchoring the model to the exact Tr(X0) and Tr(X1) of the matrix
+/// recursion at mu0, so the step is never worse than Newton close to
+/// the solution but follows the estimated spectrum for large steps.
+/// The anchored model is solved for nocc by scalar Newton iterations,
+/// replaying sgnlist.
+/// Each model trial costs O(nnodes*nsteps) flops instead of nsteps
+/// matrix squarings. Adds the trials to scount and falls back to zero
+/// (caller keeps its own step) if the model does not converge.
+static real_t densityStep(const SpectralDensity* dos,
+                          const int nsteps,
+                          const real_t nocc,
+                          const real_t mu0,
+                          const real_t traceX0,
+                          const real_t traceX1,
+                          int* sgnlist,
+                          const real_t h1,
+                          const real_t hN,
+                          const real_t occErrLimit,
+                          const real_t traceLimit,
+                          int* scount)
+{
+  real_t modelX0, modelX1;
+  real_t mu = mu0;
+
+  densityRecursion(dos, mu, nsteps, nocc, h1, hN, sgnlist, 0, 
+    &modelX0, &modelX1);
+  (*scount)++;
+  real_t offset = traceX0 - modelX0;
+  real_t slope = traceX1 - modelX1;
+
+  for (int iter = 0; iter < HUNDRED; iter++)
+  {
+    real_t g = nocc - (modelX0 + offset + slope * (mu - mu0));
+    if (ABS(g) <= occErrLimit)
+      return mu - mu0;
+
+    mu += occupationStep(g, modelX1 + slope, ZERO, 1, traceLimit);
+    densityRecursion(dos, mu, nsteps, nocc, h1, hN, sgnlist, 0,
+      &modelX0, &modelX1);
+    (*scount)++;
+  }
+
+  return ZERO;
+}
+
+/// \details
+/// Chemical potential search over ncand concurrent candidates.
+///
+/// Each round evaluates the recursion for ncand values of mu spread
+/// evenly over [center - width, center + width], one candidate per
+/// OpenMP thread. When two neighbouring candidates bracket the target
+/// occupation, the next round is centered on their secant root and
+/// spans 1/ncand of the bracket, so the candidate spacing shrinks each
+/// round even for ncand = 2. Otherwise it is centered on the Newton
+/// step from the best candidate. Returns the index of the converged
+/// candidate, or of the best one if the occupation error is still
+/// above the limit after HUNDRED rounds, e.g. when thresholding noise
+/// in Tr(X0) exceeds it.
+static int muSearch(FermiWork* work,
+                    const int ncand,
+                    const bml_matrix_t* xh_bml,
+                    const bml_matrix_t* xh2_bml,
+                    const bml_matrix_t* i_bml,
+                    const int nsteps,
+                    const real_t nocc,
+                    const real_t h1,
+                    const real_t hN,
+                    int* sgnlist,
+                    real_t center,
+                    real_t width,
+                    const real_t occErrLimit,
+                    const real_t traceLimit,
+                    const real_t threshold,
+                    int* lcount,
+                    int* ncount)
+{
+  int best = 0;
+  real_t occErr = ONE + occErrLimit;
+
+  // Never collapse the bracket below round-off of the spectral scale
+  real_t minWidth = 1.0E-12 * (hN - h1);
+  int round = 0;
+
+  while (occErr > occErrLimit && round < HUNDRED)
+  {
+    round++;
+    (*lcount)++;
+    width = MAX(width, minWidth);
+
+    for (int k = 0; k < ncand; k++)
+      work[k].mu = center + width * (TWO * k / (ncand - 1) - ONE);
+
+    startTimer(muSearchInitTimer);
+    #pragma omp parallel for schedule(static, 1)
+    for (int k = 0; k < ncand; k++)
+    {
+      fermiRecursion(&work[k], xh_bml, xh2_bml, i_bml, nsteps, nocc, h1, hN,
+        sgnlist, 0, threshold);
+    }
+    stopTimer(muSearchInitTimer);
+    *ncount += ncand * nsteps;
+
+    best = 0;
+    for (int k = 1; k < ncand; k++)
+    {
+      if (ABS(nocc - work[k].traceX0) < ABS(nocc - work[best].traceX0))
+        best = k;
+    }
+    occErr = ABS(nocc - work[best].traceX0);
+
+    if (bml_printRank() && debug_i == 1)
+      printf("muSearch: mu = %lg occErr = %lg width = %lg\n", 
+        work[best].mu, occErr, width);
+
+    if (occErr <= occErrLimit) break;
+
+    // Look for a pair of candidates that brackets the target occupation
+    int bracket = -1;
+    for (int k = 0; k < ncand - 1; k++)
+    {
+      real_t fk = nocc - work[k].traceX0;
+      real_t fk1 = nocc - work[k+1].traceX0;
+      if ((fk < ZERO && fk1 > ZERO) || (fk > ZERO && fk1 < ZERO))
+      {
+        bracket = k;
+        break;
+      }
+    }
+
+    if (bracket >= 0)
+    {
+      // Secant root inside the bracket
+      FermiWork* a = &work[bracket];
+      FermiWork* b = &work[bracket+1];
+      real_t fa = nocc - a->traceX0;
+      real_t fb = nocc - b->traceX0;
+      center = a->mu - fa * (b->mu - a->mu) / (fb - fa);
+      width = HALF * ABS(b->mu - a->mu) / ncand;
+    }
+    else
+    {
+      // All candidates on one side, step from the best one
+      real_t lambda = muStep(&work[best], nocc, traceLimit);
+      center = work[best].mu + lambda;
+      width = MAX(ABS(lambda), width);
+    }
+  }
+
+  if (occErr > occErrLimit && bml_printRank())
+    printf("muSearch not converged after %d rounds, occErr = %lg\n", 
+      round, occErr);
+
+  return best;
+}
+
 /// \details
 /// Finite temperature truncated SP2 Fermi init.
 /// The second order spectral projection algorithm.
+///
+/// With muCands_i > 1 the chemical potential search after the first
+/// pass evaluates muCands_i candidates concurrently (see muSearch).
 void sp2Init(const bml_matrix_t* h_bml,
              bml_matrix_t* rho_bml,
              const int nsteps,
@@ -63,138 +602,111 @@ void sp2Init(const bml_matrix_t* h_bml,
   bml_matrix_precision_t precision = bml_get_precision(h_bml);
   bml_distribution_mode_t dmode = bml_get_distribution_mode(h_bml);
 
-  // Calculate gershgorin bounds and rescale
-  real_t* gbnd = bml_gershgorin(h_bml);
-  *mu = 0.5 * (gbnd[1] + gbnd[0]);
-  *h1 = tscale * gbnd[0];
-  *hN = tscale * gbnd[1];
-  bml_free_memory(gbnd);
+  // Calculate spectral bounds (Gershgorin or Lanczos) and rescale
+  real_t* gbnd = spectralBounds(h_bml, nocc, threshold);
+  fermiBounds(gbnd, tscale, mu, h1, hN);
 
-  real_t traceX, traceX0, traceX1, traceX2;
+  real_t traceX, traceX0, traceX1;
   real_t lambda = ZERO;
   real_t occErr = ONE;
   int firstTime = 1;
+  int scount = 0;
   int lcount = 0;
   int ncount = 0;
+  int ncand = MAX(muCands_i, 1);
+  int nwork = 1;
+  int best = 0;
 
-  real_t* trace = bml_allocate_memory(2*sizeof(real_t));
-
+  // Candidate 0 builds X0 in rho
+  FermiWork* work = bml_allocate_memory(ncand * sizeof(FermiWork));
+  allocFermiWork(&work[0], h_bml, rho_bml);
   bml_matrix_t* i_bml = bml_identity_matrix(bml_type, precision, N, M, dmode);
-  bml_matrix_t* x1_bml = bml_zero_matrix(bml_type, precision, N, M, dmode);
-  bml_matrix_t* x2_bml = bml_zero_matrix(bml_type, precision, N, M, dmode);
-  bml_matrix_t* tmp_bml = bml_zero_matrix(bml_type, precision, N, M, dmode);
 
-  while (occErr > occErrLimit)
+  // Normalized H at mu = 0, kept across mu updates
+  startTimer(copyInitTimer);
+  bml_matrix_t* xh_bml = bml_copy_new(h_bml);
+  stopTimer(copyInitTimer);
+  startTimer(normInitTimer);
+  normalize(xh_bml, *h1, *hN, ZERO);
+  stopTimer(normInitTimer);
+  startTimer(x2InitTimer);
+  bml_matrix_t* xh2_bml = bml_zero_matrix(bml_type, precision, N, M, dmode);
+  real_t* trace = bml_multiply_x2(xh_bml, xh2_bml, threshold);
+  bml_free_memory(trace);
+  stopTimer(x2InitTimer);
+  work[0].nmult++;
+
+  // Optional stochastic density of states to predict mu steps
+  SpectralDensity* dos = NULL;
+  if (occProbes_i > 0)
   {
-    lcount++;
-    startTimer(copyInitTimer);
-    bml_copy(h_bml, rho_bml);
-    stopTimer(copyInitTimer);
-    startTimer(normInitTimer);
-    normalize(rho_bml, *h1, *hN, *mu);
-    stopTimer(normInitTimer);
+    startTimer(stochInitTimer);
+    dos = stochasticDensity(h_bml, gbnd[0], gbnd[1], kpmMoments_i, 
+      occProbes_i, threshold);
+    stopTimer(stochInitTimer);
+  }
+  bml_free_memory(gbnd);
 
-    // X1 = -I/(hN-h1)
-    startTimer(copyInitTimer);
-    bml_copy(i_bml, x1_bml);
-    stopTimer(copyInitTimer);
-    real_t sfactor = MINUS_ONE / (*hN - *h1);
-    bml_scale_inplace(&sfactor, x1_bml);
+  // The first pass fixes the branch sequence. Without candidates the
+  // Newton search continues here.
+  do
+  {
+    lcount++;
+    work[0].mu = *mu;
+    fermiRecursion(&work[0], xh_bml, xh2_bml, i_bml, nsteps, nocc, *h1, *hN,
+      sgnlist, firstTime, threshold);
+    ncount += nsteps;
 
-    for (int i = 0; i < nsteps; i++)
-    {
-      ncount++;
-      startTimer(x2InitTimer);
-      trace = bml_multiply_x2(rho_bml, x2_bml, threshold);
-      stopTimer(x2InitTimer);
-      traceX0 = trace[0];
-      traceX2 = trace[1];
+    firstTime = 0;
+    occErr = ABS(nocc - work[0].traceX0);
 
-      // First time through determine sequence branching
-      if (firstTime == 1)
-      {
-        if (ABS(traceX2-nocc) < ABS(TWO * traceX0 - traceX2 - nocc))
-          sgnlist[i] = -1;
-        else
-          sgnlist[i] = 1;
-      }
+    // Newton-Rhapson step to correct for occupation
+    lambda = muStep(&work[0], nocc, traceLimit);
 
-      // X1 = X1 + sgnlist(i)*(X1 - X0*X1 - X1*X0)
-      // if sgnlist == 1, X1 = 2 * X1 - (X0*X1 + X1*X0)
-      // if sgnlist == -1, X1 = X0*X1 + X1*X0
-      // 
-      // tmp = X0*X1 + X1*X0
-      startTimer(mmInitTimer);
-      bml_multiply(rho_bml, x1_bml, tmp_bml, ONE, ZERO, threshold);
-      stopTimer(mmInitTimer);
-      startTimer(mmInitTimer);
-      bml_multiply(x1_bml, rho_bml, tmp_bml, ONE, ONE, threshold);
-      stopTimer(mmInitTimer);
+    if (dos != NULL && occErr > occErrLimit)
+    {
+      startTimer(stochInitTimer);
+      real_t dlambda = densityStep(dos, nsteps, nocc, work[0].mu, 
+        work[0].traceX0, work[0].traceX1, sgnlist, *h1, *hN, occErrLimit, traceLimit,
+        &scount);
+      stopTimer(stochInitTimer);
+      if (dlambda != ZERO) lambda = dlambda;
+    }
 
-      if (sgnlist[i] == 1)
-      {
-        // X1 = 2 * X1 - tmp
-        startTimer(xaddInitTimer);
-        bml_add(x1_bml, tmp_bml, TWO, MINUS_ONE, threshold);
-        stopTimer(xaddInitTimer);
-      }
-      else
-      {
-        startTimer(copyInitTimer);
-        bml_copy(tmp_bml, x1_bml);
-        stopTimer(copyInitTimer);
-      }
+    if (bml_printRank() && debug_i == 1)
+      printf("sp2Init: mu = %lg occErr = %lg lambda = %lg\n", 
+        work[0].mu, occErr, lambda);
 
-      // X0 = X0 + sgnlist(i)*(X0 - X0_2)
-      // if sgnlist == 1, X0 = 2.0*X0 - X0_2
-      // if sgnlist == -1, X0 = X0_2
-      // 
-      if (sgnlist[i] == 1)
-      {
-        // X0 = 2 * X0 - X2
-        startTimer(xaddInitTimer);
-        bml_add(rho_bml, x2_bml, TWO, MINUS_ONE, threshold);
-        stopTimer(xaddInitTimer);
-      }
-      else
-      {
-        startTimer(copyInitTimer);
-        bml_copy(x2_bml, rho_bml);
-        stopTimer(copyInitTimer);
-      }
-    }
+    *mu += lambda;
+  } while (occErr > occErrLimit && ncand == 1);
 
-    firstTime = 0;
-    traceX0 = bml_trace(rho_bml);
-    traceX1 = bml_trace(x1_bml);
-    occErr = ABS(nocc - traceX0);
+  if (occErr > occErrLimit)
+  {
+    for (nwork = 1; nwork < ncand; nwork++)
+      allocFermiWork(&work[nwork], h_bml, NULL);
 
-    // Newton=Rhapson step to correct for occupation
-    if (ABS(traceX1) > traceLimit)
-      lambda = (nocc - traceX0) / traceX1;
-    else
-      lambda = ZERO;
+    best = muSearch(work, ncand, xh_bml, xh2_bml, i_bml, nsteps, nocc, *h1, *hN,
+      sgnlist, *mu, ABS(lambda), occErrLimit, traceLimit, threshold,
+      &lcount, &ncount);
 
-    *mu += lambda;
-    //printf("mu = %lg traceX0 = %lg occErr = %lg occErrLimit = %lg\n", *mu, traceX0, occErr, occErrLimit);
+    lambda = muStep(&work[best], nocc, traceLimit);
+    *mu = work[best].mu + lambda;
   }
 
-  bml_free_memory(trace);
-  bml_deallocate(&x2_bml);
+  traceX0 = work[best].traceX0;
+  traceX1 = work[best].traceX1;
 
-  // X0*(I-X0)
-  // I = I - X0
-  startTimer(xaddInitTimer);
-  bml_add(i_bml, rho_bml, ONE, MINUS_ONE, threshold);
-  stopTimer(xaddInitTimer);
-
-  // tmp = X0*I
-  startTimer(mmInitTimer);
-  bml_multiply(rho_bml, i_bml, tmp_bml, ONE, ZERO, threshold);
-  stopTimer(mmInitTimer);
+  // Final X0 may sit in another buffer after swaps or the search
+  if (work[best].x0_bml != rho_bml)
+  {
+    startTimer(copyInitTimer);
+    bml_copy(work[best].x0_bml, rho_bml);
+    stopTimer(copyInitTimer);
+  }
 
-  traceX = bml_trace(tmp_bml);
-  traceX1 = bml_trace(x1_bml);
+  // Tr(X0*(I-X0)) = Tr(X0) - Tr(X0^2), and Tr(X0^2) = ||X0||_F^2
+  // for symmetric X0, so no product is needed
+  traceX = traceX0 - bml_sum_squares(rho_bml);
 
   if (ABS(traceX) > traceLimit)
     *beta = -traceX1 / traceX;
@@ -204,17 +716,31 @@ void sp2Init(const bml_matrix_t* h_bml,
   // X = 2 * X
   bml_scale_inplace(&TWO, rho_bml);
 
-  bml_deallocate(&tmp_bml);
+  int nmult = 0;
+  for (int k = 0; k < nwork; k++)
+  {
+    nmult += work[k].nmult;
+    freeFermiWork(&work[k], rho_bml);
+  }
+  bml_free_memory(work);
+  if (dos != NULL) destroySpectralDensity(&dos);
+  bml_deallocate(&xh_bml);
+  bml_deallocate(&xh2_bml);
   bml_deallocate(&i_bml);
-  bml_deallocate(&x1_bml);
 
+  if (occProbes_i > 0)
+    printf("scount = %d stochastic density model trials\n", scount);
   printf("lcount = %d iterations through while loop\n", lcount);
   printf("ncount = %d iterations through nsteps loop\n", ncount);
+  printf("nmult = %d matrix multiplies\n", nmult);
 } 
 
 /// \details
 /// Finite temperature truncated SP2 Fermi loop.
 /// The second order spectral projection algorithm.
+///
+/// With muOrder_i = 2 the mu update is a Halley step, Tr(D2X) coming
+/// from the Fermi-Dirac form of X0 at one multiply per pass.
 void sp2Loop(const bml_matrix_t* h_bml,
              bml_matrix_t* rho_bml,
              const int nsteps,
@@ -235,87 +761,123 @@ void sp2Loop(const bml_matrix_t* h_bml,
   bml_matrix_precision_t precision = bml_get_precision(h_bml);
   bml_distribution_mode_t dmode = bml_get_distribution_mode(h_bml);
 
-  real_t* trace = bml_allocate_memory(2*sizeof(real_t));
+  real_t* trace;
 
-  bml_matrix_t* i_bml = bml_identity_matrix(matrix_type, precision, N, M, dmode);
-  bml_matrix_t* dx_bml = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+  // X0 is double buffered with X2
+  bml_matrix_t* x0_bml = rho_bml;
   bml_matrix_t* x2_bml = bml_zero_matrix(matrix_type, precision, N, M, dmode);
 
-  real_t traceX0, traceX2, traceDX, lambda;
+  real_t traceX0, traceX2, traceDX;
+  real_t traceD2X = ZERO;
+  real_t lambda = ZERO;
   real_t occErr = ONE + occLimit;
   int iter = 0;
 
+  // Normalized H at mu = 0, kept across mu updates
+  startTimer(copyTimer);
+  bml_matrix_t* xh_bml = bml_copy_new(h_bml);
+  stopTimer(copyTimer);
+  startTimer(normTimer);
+  normalize(xh_bml, h1, hN, ZERO);
+  stopTimer(normTimer);
+  startTimer(x2Timer);
+  bml_matrix_t* xh2_bml = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+  trace = bml_multiply_x2(xh_bml, xh2_bml, threshold);
+  bml_free_memory(trace);
+  stopTimer(x2Timer);
+
   while ((osteps == 0 && occErr > occLimit) ||
          (osteps > 0 && iter < osteps))
   {
     iter += 1;
+
+    // X0 = Xh - mu/(hN-h1) * I, and its square
     startTimer(copyTimer);
-    bml_copy(h_bml, rho_bml);
+    shiftedStart(xh_bml, xh2_bml, (*mu) / (hN - h1), x0_bml, x2_bml,
+      &traceX0, &traceX2, threshold);
     stopTimer(copyTimer);
-    startTimer(normTimer);
-    normalize(rho_bml, h1, hN, *mu);
-    stopTimer(normTimer);
 
     for (int i = 0; i < nsteps; i++)
     {
-      startTimer(x2Timer);
-      trace = bml_multiply_x2(rho_bml, x2_bml, threshold);
-      stopTimer(x2Timer);
-      traceX0 = trace[0];
-      traceX2 = trace[1];
+      if (i > 0)
+      {
+        startTimer(x2Timer);
+        trace = bml_multiply_x2(x0_bml, x2_bml, threshold);
+        stopTimer(x2Timer);
+        traceX0 = trace[0];
+        traceX2 = trace[1];
+        bml_free_memory(trace);
+      }
 
       // X0 = X0 + sgnlist(i)*(X0 - X0_2)
       if (sgnlist[i] == 1)
       {
         startTimer(xaddTimer);
-        bml_add(rho_bml, x2_bml, TWO, MINUS_ONE, threshold);
+        bml_add(x0_bml, x2_bml, TWO, MINUS_ONE, threshold);
         stopTimer(xaddTimer);
       }
       else
       {
-        startTimer(copyTimer);
-        bml_copy(x2_bml, rho_bml);
-        stopTimer(copyTimer);
+        swapMatrix(&x0_bml, &x2_bml);
       }
     }
 
-    traceX0 = bml_trace(rho_bml);
+    traceX0 = bml_trace(x0_bml);
     occErr = ABS(nocc - traceX0);
 
-    // DX = -beta*X0*(I-X0)
-    startTimer(copyTimer);
-    bml_copy(i_bml, x2_bml);
-    stopTimer(copyTimer);
-    startTimer(xaddTimer);
-    bml_add(x2_bml, rho_bml, ONE, MINUS_ONE, threshold);
-    stopTimer(xaddTimer);
-    startTimer(mmTimer);
-    bml_multiply(rho_bml, x2_bml, dx_bml, -beta, ZERO, threshold);
-    stopTimer(mmTimer);
-    traceDX = bml_trace(dx_bml);
-
-    // Newton-Rhapson step to correct for occupation
-    if (ABS(traceDX) > traceLimit)
-      lambda = (nocc - traceX0) / traceDX;
+    if (muOrder_i > 1)
+    {
+      // Tr(D2X) = beta^2*Tr(X0*(I-X0)*(I-2*X0))
+      //         = beta^2*(Tr(X0) - 3*Tr(X0^2) + 2*Tr(X0^3))
+      startTimer(x2Timer);
+      trace = bml_multiply_x2(x0_bml, x2_bml, threshold);
+      stopTimer(x2Timer);
+      traceX2 = trace[1];
+      bml_free_memory(trace);
+      traceDX = -beta * (traceX0 - traceX2);
+      traceD2X = beta * beta * (traceX0 - THREE * traceX2 + 
+        TWO * bml_trace_mult(x0_bml, x2_bml));
+    }
     else
-      lambda = ZERO;
+    {
+      // Tr(DX) = -beta*Tr(X0*(I-X0)) = -beta*(Tr(X0) - Tr(X0^2)),
+      // with Tr(X0^2) = ||X0||_F^2 for symmetric X0
+      traceDX = -beta * (traceX0 - bml_sum_squares(x0_bml));
+    }
+
+    // Newton-Rhapson (or Halley) step to correct for occupation
+    lambda = occupationStep(nocc - traceX0, traceDX, traceD2X, muOrder_i,
+      traceLimit);
 
     *mu += lambda;
 
   }
 
-  // Correction for occupation
+  // Final X0 may sit in the scratch buffer after an odd number of swaps
+  if (x0_bml != rho_bml)
+  {
+    startTimer(copyTimer);
+    bml_copy(x0_bml, rho_bml);
+    stopTimer(copyTimer);
+    x2_bml = x0_bml;
+  }
+
+  // Correction for occupation, formed once
+  // X0 + lambda*DX = (1 - lambda*beta)*X0 + lambda*beta*X0^2
+  startTimer(x2Timer);
+  trace = bml_multiply_x2(rho_bml, x2_bml, threshold);
+  stopTimer(x2Timer);
+  bml_free_memory(trace);
   startTimer(xaddTimer);
-  bml_add(rho_bml, dx_bml, ONE, lambda, threshold);
+  bml_add(rho_bml, x2_bml, ONE - lambda * beta, lambda * beta, threshold);
   stopTimer(xaddTimer);
 
   // X = 2*X
   bml_scale_inplace(&TWO, rho_bml);
 
-  bml_free_memory(trace);
-  bml_deallocate(&i_bml);
+  bml_deallocate(&xh_bml);
+  bml_deallocate(&xh2_bml);
   bml_deallocate(&x2_bml);
-  bml_deallocate(&dx_bml);
 }
 
 /// \details
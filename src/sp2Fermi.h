@@ -15,6 +15,12 @@ void normalize(bml_matrix_t* h_bml,
                const real_t hN, 
                const real_t mu);
 
+int recursionDepth(const bml_matrix_t* h_bml,
+                   const real_t nocc,
+                   const real_t beta,
+                   const real_t tscale,
+                   const real_t threshold);
+
 void sp2Init(const bml_matrix_t* h_bml, 
              bml_matrix_t* rho_bml, 
              const int nsteps, 
@@ -0,0 +1,268 @@
+/// \file
+/// Graph-partitioned SP2 loop.
+///
+/// Each part of a graph partition of H (see graphPartition) is solved
+/// on the dense submatrix of its core and halo rows, with the parts
+/// distributed over OpenMP threads. All parts are normalized with the
+/// global spectral bounds and run the same SP2 sequence: each step
+/// forms X^2 of every part, the traces of X and X^2 restricted to the
+/// core rows are summed over the parts, which gives the global traces,
+/// and the branch is chosen from them as in sp2Step. The core rows of
+/// the final parts are the rows of P.
+///
+/// Parts only exchange two numbers per step, so they need no halo
+/// exchange. The cost is that halo rows are computed by more than one
+/// part, and that the result is exact only as far as P decays within
+/// the halo, which --graphHops controls.
+
+#if defined(SP2_BASIC) && defined(DECOMP_GRAPH)
+
+#include "bml.h"
+
+#include "sp2Graph.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <omp.h>
+
+#include "sp2Basic.h"
+#include "performance.h"
+#include "parallel.h"
+#include "constants.h"
+#include "csrMatrix.h"
+#include "lanczos.h"
+
+/// Matrices and traces of one part.
+typedef struct GraphWorkSt
+{
+  bml_matrix_t* x_bml;   //!< X of the part
+  bml_matrix_t* x2_bml;  //!< X^2 of the part
+  real_t trX;            //!< trace of X over the core rows
+  real_t trX2;           //!< trace of X^2 over the core rows
+  double time;           //!< time spent in the part
+} GraphWork;
+
+/// \details
+/// Sum of the first ncore diagonal elements.
+static real_t coreTrace(const bml_matrix_t* a_bml,
+                        const int ncore)
+{
+  real_t* diag = bml_get_diagonal((bml_matrix_t*) a_bml);
+  real_t sum = ZERO;
+  for (int i = 0; i < ncore; i++)
+    sum += diag[i];
+  bml_free_memory(diag);
+
+  return sum;
+}
+
+/// \details
+/// SP2 on the parts of gp in lock step. The stopping rules are those
+/// of sp2Loop, applied to the global traces. Per part times are
+/// reported at the end.
+void graphSp2Loop(const bml_matrix_t* h_bml,
+                  bml_matrix_t* rho_bml,
+                  const real_t nocc,
+                  const GraphPartition* gp,
+                  const int minsp2iter,
+                  const int maxsp2iter,
+                  const real_t idemTol,
+                  const real_t threshold)
+{
+  int N = bml_get_N(h_bml);
+  bml_matrix_precision_t precision = bml_get_precision(h_bml);
+  int nparts = gp->nparts;
+
+  startTimer(sp2LoopTimer);
+
+  startTimer(normTimer);
+  real_t* bnd = spectralBounds(h_bml, nocc, threshold);
+  stopTimer(normTimer);
+
+  // Normalized submatrix of each part
+  startTimer(assembleTimer);
+  CsrMatrix* h = csrFromBml(h_bml, threshold);
+  GraphWork* work = calloc(nparts, sizeof(GraphWork));
+  #pragma omp parallel
+  {
+    int* local = malloc(N * sizeof(int));
+    for (int i = 0; i < N; i++)
+      local[i] = -1;
+
+    #pragma omp for schedule(dynamic)
+    for (int p = 0; p < nparts; p++)
+    {
+      double t0 = omp_get_wtime();
+      int n = gp->size[p];
+      real_t* a = malloc((size_t) n * n * sizeof(real_t));
+      csrSubmatrix(h, gp->index[p], n, local, a);
+      work[p].x_bml = bml_import_from_dense(dense, precision, dense_row_major,
+        n, n, a, ZERO, sequential);
+      work[p].x2_bml = bml_zero_matrix(dense, precision, n, n, sequential);
+      normalizeBounds(work[p].x_bml, bnd[0], bnd[1]);
+      free(a);
+      work[p].time = omp_get_wtime() - t0;
+    }
+
+    free(local);
+  }
+  csrDestroy(&h);
+  bml_free_memory(bnd);
+  stopTimer(assembleTimer);
+
+  real_t idempErr = ZERO;
+  real_t idempErr1 = ZERO;
+  real_t idempErr2 = ZERO;
+  real_t idemErrN = ZERO;
+  real_t idemErrN1 = ZERO;
+  real_t idemErrN2 = ZERO;
+
+  real_t trX = ZERO;
+  real_t trX2 = ZERO;
+  real_t trXOLD;
+
+  int iter = 0;
+  int branch;
+  int branchOld = 0;
+  int breakLoop = 0;
+
+  while (breakLoop == 0 && iter < maxsp2iter)
+  {
+    // X^2 of every part, core traces
+    startTimer(x2Timer);
+    #pragma omp parallel for schedule(dynamic)
+    for (int p = 0; p < nparts; p++)
+    {
+      double t0 = omp_get_wtime();
+      int ncore = gp->coreStart[p+1] - gp->coreStart[p];
+      bml_multiply(work[p].x_bml, work[p].x_bml, work[p].x2_bml, ONE, ZERO,
+        threshold);
+      work[p].trX = coreTrace(work[p].x_bml, ncore);
+      work[p].trX2 = coreTrace(work[p].x2_bml, ncore);
+      work[p].time += omp_get_wtime() - t0;
+    }
+    stopTimer(x2Timer);
+
+    trX = ZERO;
+    trX2 = ZERO;
+    for (int p = 0; p < nparts; p++)
+    {
+      trX += work[p].trX;
+      trX2 += work[p].trX2;
+    }
+
+    real_t tr2XX2 = TWO * trX - trX2;
+    real_t limDiff = ABS(trX2 - nocc) - ABS(tr2XX2 - nocc);
+    if (limDiff > idemTol)
+      branch = 1;
+    else if (limDiff < -idemTol)
+      branch = -1;
+    else
+      branch = 0;
+
+    // Same branch in every part
+    startTimer(xaddTimer);
+    #pragma omp parallel for schedule(dynamic)
+    for (int p = 0; p < nparts; p++)
+    {
+      double t0 = omp_get_wtime();
+      if (branch == 1)
+        bml_add(work[p].x_bml, work[p].x2_bml, TWO, MINUS_ONE, threshold);
+      else if (branch == -1)
+      {
+        bml_matrix_t* tmp_bml = work[p].x_bml;
+        work[p].x_bml = work[p].x2_bml;
+        work[p].x2_bml = tmp_bml;
+      }
+      work[p].time += omp_get_wtime() - t0;
+    }
+    stopTimer(xaddTimer);
+
+    if (bml_printRank() && debug_i == 1) 
+      printf("iter = %d  trX = %e  trX2 = %e\n", iter, trX, trX2);
+
+    trXOLD = trX;
+    if (branch == 1)
+      trX = tr2XX2;
+    else if (branch == -1)
+      trX = trX2;
+    else
+      breakLoop = 1;
+
+    idempErr2 = idempErr1;
+    idempErr1 = idempErr;
+    idempErr = ABS(trX - trXOLD);
+
+    iter++;
+
+    idemErrN2 = idemErrN1;
+    idemErrN1 = idemErrN;
+    idemErrN = ABS(trXOLD - trX2);
+
+    // As in sp2Loop, the minIter test is the fallback of stopRule 1
+    if (stopRule_i == 1 && iter >= 3 && branch != branchOld && 
+        idemErrN > 4.0 * idemErrN2 * idemErrN2) breakLoop = 1;
+    if (iter >= minsp2iter && (idempErr >= idempErr2)) breakLoop = 1;
+    branchOld = branch;
+  }
+
+  // Core rows of 2X into P
+  startTimer(assembleTimer);
+  real_t* row = calloc(N, sizeof(real_t));
+  for (int p = 0; p < nparts; p++)
+  {
+    double t0 = omp_get_wtime();
+    int n = gp->size[p];
+    int ncore = gp->coreStart[p+1] - gp->coreStart[p];
+    real_t* x = bml_export_to_dense(work[p].x_bml, dense_row_major);
+    for (int i = 0; i < ncore; i++)
+    {
+      for (int q = 0; q < n; q++)
+        row[gp->index[p][q]] = TWO * x[(size_t) i * n + q];
+      bml_set_row(rho_bml, gp->index[p][i], row, threshold);
+      for (int q = 0; q < n; q++)
+        row[gp->index[p][q]] = ZERO;
+    }
+    bml_free_memory(x);
+    bml_deallocate(&work[p].x_bml);
+    bml_deallocate(&work[p].x2_bml);
+    work[p].time += omp_get_wtime() - t0;
+  }
+  free(row);
+
+  // Row i and column i come from different parts
+  bml_matrix_t* t_bml = bml_transpose_new(rho_bml);
+  bml_add(rho_bml, t_bml, HALF, HALF, threshold);
+  bml_deallocate(&t_bml);
+  stopTimer(assembleTimer);
+
+  stopTimer(sp2LoopTimer);
+
+  if (bml_printRank())
+  {
+    double tmin = work[0].time;
+    double tmax = work[0].time;
+    double tsum = ZERO;
+    for (int p = 0; p < nparts; p++)
+    {
+      tmin = MIN(tmin, work[p].time);
+      tmax = MAX(tmax, work[p].time);
+      tsum += work[p].time;
+      if (debug_i == 1)
+        printf("part %d: core %d halo %d time %lg s\n", p,
+          gp->coreStart[p+1] - gp->coreStart[p],
+          gp->size[p] - (gp->coreStart[p+1] - gp->coreStart[p]),
+          work[p].time);
+    }
+    printf("Graph SP2: %d iterations, final idempotency error %e\n", iter,
+      idemErrN);
+    printf("Part times: min %lg avg %lg max %lg s (imbalance %lg)\n", tmin,
+      tsum / nparts, tmax, tmax * nparts / tsum);
+    printf("Tr(P) = %lg  2*nocc = %lg\n", bml_trace(rho_bml), TWO * nocc);
+  }
+
+  free(work);
+}
+
+#endif
@@ -0,0 +1,23 @@
+/// \file
+/// Graph-partitioned SP2 functions.
+
+#ifndef __SP2GRAPH_H
+#define __SP2GRAPH_H
+
+#include "bml.h"
+
+#include <stdio.h>
+
+#include "mytype.h"
+#include "graphPartition.h"
+
+void graphSp2Loop(const bml_matrix_t* h_bml,
+                  bml_matrix_t* rho_bml,
+                  const real_t nocc,
+                  const GraphPartition* gp,
+                  const int minsp2iter,
+                  const int maxsp2iter,
+                  const real_t idemTol,
+                  const real_t threshold);
+
+#endif
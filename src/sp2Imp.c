@@ -14,6 +14,21 @@
 #include "performance.h"
 #include "parallel.h"
 #include "constants.h"
+#include "lanczos.h"
+
+/// Maximum number of iterations of one conjugate gradient solve
+#define CG_MAX_ITER 100
+
+/// CG iterations without a new smallest residual after which a solve
+/// stops, its residual being at the noise level left by thresholding
+#define CG_STALL 5
+
+/// Maximum number of Newton-Schulz iterations for one inverse
+#define NS_MAX_ITER 50
+
+/// Smallest ratio of the first CG residual to cg_tol for the automatic
+/// recursion depth
+#define CG_DEPTH_MARGIN 10.0
 
 /// \details
 /// Normalize a Hamiltonian matrix prior to running the implicit recursive algorithm.
@@ -28,20 +43,265 @@ void normalize(bml_matrix_t* h_bml, const real_t cnst, const real_t mu)
   bml_scale_add_identity(h_bml, alpha, beta, ZERO);
 }
 
+/// \details
+/// Smallest number of recursion steps whose Fermi-Dirac approximation
+/// meets the occupation error limit, for use when rec_steps is not
+/// given.
+///
+/// The scalar version of the recursion, with the normalization of
+/// implicit_recursiveLoops, is run on a grid over the spectral
+/// bounds [h1, hN] for increasing depth n (exp_order = 2^n). The
+/// occupation error is estimated assuming the N states are spread
+/// evenly over the interval:
+///
+///   occErr(n) = N/(hN - h1) * integral |x_n(e) - f(e)| de
+///
+/// with f(e) = 1/(1 + exp(beta*(e - mu))). The grid resolves 1/beta.
+///
+/// The depth is capped where the CG solves could no longer resolve the
+/// steps. The first solve starts from a residual of about Tr(Y0^2)/4,
+/// with Y0 = cnst(mu*I - H), i.e.
+///
+///   cnst^2 (||H||_F^2 - 2 mu Tr(H) + N mu^2) / 4
+///
+/// Once this falls below cg_tol, no step does any CG iteration and P
+/// stays at X0. The cap keeps it at least CG_DEPTH_MARGIN*cg_tol; a
+/// warning is printed if that depth misses the occupation error limit.
+/// nocc and threshold are passed to spectralBounds.
+int recursionDepth(const bml_matrix_t* h_bml,
+                   const real_t nocc,
+                   const real_t beta,
+                   const real_t mu,
+                   const real_t occErrLimit,
+                   const real_t cg_tol,
+                   const real_t threshold)
+{
+  const int maxDepth = 30;
+  int N = bml_get_N(h_bml);
+
+  real_t hnorm = bml_fnorm((bml_matrix_t*) h_bml);
+  real_t hshift = hnorm * hnorm - TWO * mu * bml_trace(h_bml) + N * mu * mu;
+  int capDepth = 1;
+  while (capDepth < maxDepth)
+  {
+    real_t cnst = beta / (4.0 * pow(2, capDepth + 1));
+    if (cnst * cnst * hshift / 4.0 < CG_DEPTH_MARGIN * cg_tol)
+      break;
+    capDepth++;
+  }
+
+  real_t* gbnd = spectralBounds(h_bml, nocc, threshold);
+  real_t h1 = gbnd[0];
+  real_t hN = gbnd[1];
+  bml_free_memory(gbnd);
+
+  real_t width = hN - h1;
+  int ngrid = (int) MAX(4096.0, MIN(100000.0, 32.0 * beta * width));
+  real_t de = width / ngrid;
+
+  for (int n = 1; n <= maxDepth; n++)
+  {
+    real_t cnst = beta / (4.0 * pow(2, n));
+    real_t err = ZERO;
+
+    for (int j = 0; j < ngrid; j++)
+    {
+      real_t e = h1 + (j + HALF) * de;
+      real_t x = cnst * (mu - e) + HALF;
+      for (int i = 0; i < n; i++)
+        x = x * x / (x * x + (ONE - x) * (ONE - x));
+      err += ABS(x - ONE / (ONE + exp(beta * (e - mu))));
+    }
+
+    if (N * err * de / width <= occErrLimit || n == capDepth)
+    {
+      if (N * err * de / width > occErrLimit && bml_printRank())
+        printf("Warning: recursion depth capped at %d for cg_tol = %lg, "
+          "occErr = %lg\n", n, cg_tol, N * err * de / width);
+      return n;
+    }
+  }
+
+  return maxDepth;
+}
+
+/// \details
+/// Set up the preconditioner for A = 2(P^2 - P) + I from its diagonal D.
+///
+/// cg_prec = 1: Jacobi, M = D^-1
+/// cg_prec = 2: first order approximate inverse, M = D^-1 (2I - A D^-1)
+///
+/// dinv_bml must hold no off-diagonal elements. For cg_prec = 2, m_bml
+/// receives M; for cg_prec = 1, M is dinv_bml itself.
+static void setPreconditioner(const bml_matrix_t* a_bml,
+                              bml_matrix_t* dinv_bml,
+                              bml_matrix_t* m_bml,
+                              bml_matrix_t* tmp_bml,
+                              const int cg_prec,
+                              const real_t threshold)
+{
+  int N = bml_get_N(a_bml);
+
+  startTimer(linsyssetupTimer);
+  real_t* diag = bml_get_diagonal((bml_matrix_t*) a_bml);
+  for (int i = 0; i < N; i++)
+    diag[i] = ONE / diag[i];
+  bml_set_diagonal(dinv_bml, diag, ZERO);
+  bml_free_memory(diag);
+
+  if (cg_prec == 2)
+  {
+    // M = 2 D^-1 - D^-1 A D^-1
+    bml_multiply(a_bml, dinv_bml, tmp_bml, ONE, ZERO, threshold);
+    bml_multiply(dinv_bml, tmp_bml, m_bml, ONE, ZERO, threshold);
+    bml_add(m_bml, dinv_bml, MINUS_ONE, TWO, threshold);
+  }
+  stopTimer(linsyssetupTimer);
+}
+
+/// \details
+/// Bound on the Frobenius error left in the final P by an error of
+/// norm err in P after recursion step i.
+///
+/// Each step maps P to P^2 (2P^2 - 2P + I)^-1, in Y = P - I/2 the
+/// scalar map f(y) = 2y/(1 + 4y^2), whose slope is at most f'(0) = 2.
+/// The matrix map has the same bound to first order, so each later step
+/// grows the error by at most 2. States at mu reach that bound.
+static real_t propagatedError(const int i,
+                              const int rec_steps,
+                              const real_t err)
+{
+  return pow(TWO, rec_steps - i) * err;
+}
+
+/// \details
+/// CG tolerance on ||R||_F^2 for recursion step i such that the error
+/// left in the final P by all rec_steps solves is at most cg_acc.
+///
+/// The solve error is E = A^-1 R, and the spectrum of
+/// A = 2(P^2 - P) + I lies in [1/2,1], so ||E||_F <= 2 ||R||_F. It grows
+/// by up to 2^(rec_steps - i) through the later steps
+/// (propagatedError). Giving every step the same share of cg_acc, which
+/// minimizes the CG iterations when each one reduces the residual by a
+/// fixed factor, gives
+///
+///   ||R||_F <= cg_acc / (2 rec_steps 2^(rec_steps - i))
+///
+/// so early steps solve tighter than late ones.
+static real_t stepTolerance(const int i,
+                            const int rec_steps,
+                            const real_t cg_acc)
+{
+  real_t r = cg_acc / (TWO * rec_steps * propagatedError(i, rec_steps, ONE));
+
+  return r * r;
+}
+
+/// \details
+/// Newton-Schulz iteration for the inverse of A = 2(P^2 - P) + I,
+/// Ai = Ai (2I - A Ai), starting from the inverse in ai_bml.
+///
+/// The residual R = I - A Ai is squared by each iteration, so the
+/// inverse from the previous recursion step is a good starting guess
+/// while A changes slowly. If it is too far off and the residual
+/// grows, Ai restarts from 4/3 I: the spectrum of A lies in [1/2,1],
+/// so then ||R||_2 <= 1/3. Stops once ||R||_F <= ns_tol. Returns the
+/// number of iterations.
+static int newtonSchulz(const bml_matrix_t* a_bml,
+                        bml_matrix_t* ai_bml,
+                        bml_matrix_t* r_bml,
+                        bml_matrix_t* tmp_bml,
+                        const real_t ns_tol,
+                        const real_t threshold)
+{
+  real_t norm, normOld;
+  int j = 0;
+
+  // R = I - A Ai
+  startTimer(mmTimer);
+  bml_multiply(a_bml, ai_bml, r_bml, ONE, ZERO, threshold);
+  stopTimer(mmTimer);
+  bml_scale_add_identity(r_bml, MINUS_ONE, ONE, threshold);
+  norm = bml_fnorm(r_bml);
+  normOld = norm;
+
+  while (norm > ns_tol && j < NS_MAX_ITER)
+  {
+    if (norm > normOld)
+    {
+      // Diverging, restart from Ai = 4/3 I
+      bml_scale_add_identity(ai_bml, ZERO, 4.0 / 3.0, threshold);
+    }
+    else
+    {
+      // Ai = Ai + Ai R
+      bml_copy(ai_bml, tmp_bml);
+      startTimer(mmTimer);
+      bml_multiply(tmp_bml, r_bml, ai_bml, ONE, ONE, threshold);
+      stopTimer(mmTimer);
+    }
+    j++;
+
+    normOld = norm;
+    startTimer(mmTimer);
+    bml_multiply(a_bml, ai_bml, r_bml, ONE, ZERO, threshold);
+    stopTimer(mmTimer);
+    bml_scale_add_identity(r_bml, MINUS_ONE, ONE, threshold);
+    norm = bml_fnorm(r_bml);
+  }
+
+  return j;
+}
+
 /// \details
 /// The implicit recursive expansion algorithm.
-void implicit_recursiveLoops(const bml_matrix_t* h_bml, 
+///
+/// Each recursion step solves A P_new = P^2 with A = 2(P^2 - P) + I,
+/// selected by imp_method:
+///
+/// 0: conjugate gradient
+/// 1: Newton-Schulz inverse, P_new = Ai P^2, with Ai carried over from
+///    the previous step as the starting guess
+/// 2: per step, whichever of the two was measured faster. Step 1 uses
+///    CG and step 2 Newton-Schulz, after that the cost of each is the
+///    lap time (cgTimer, nsiterTimer) of its last step. Needs timers
+///    (not NTIMING), otherwise CG is always chosen.
+///
+/// With cg_guess = 1, CG starts from the secant extrapolation of the
+/// scalar map, which is exact for the RMS eigenvalue of Y = P - I/2:
+///
+/// P_new ~ I/2 + b Y,  b = 2/(1 + 4 s^2),  s^2 = Tr(Y^2)/N
+///
+/// where Tr(Y^2) = Tr(P^2) - Tr(P) + N/4 comes from the traces of the
+/// P^2 multiply. Otherwise CG starts from P. With cg_prec > 0 the
+/// solves are preconditioned (see setPreconditioner).
+///
+/// Each CG solve stops at ||R||_F^2 <= cg_tol, or with cg_schedule = 1
+/// at the tolerance from stepTolerance that bounds the error in P from
+/// the solves by cg_acc. The bound reached, from the final CG residuals
+/// and ns_tol of the Newton-Schulz steps, is reported. With cg_method = 1 the
+/// solves use pipelined CG with the same preconditioner. A CG solve
+/// that does not converge is restarted once without preconditioner on
+/// the residual equation. Returns the number of recursion steps whose
+/// solve still did not converge, or rec_steps if no step did any CG
+/// iteration.
+int implicit_recursiveLoops(const bml_matrix_t* h_bml, 
              bml_matrix_t* p_bml,
 	     const real_t beta,
 	     const real_t mu, 
              const int rec_steps,    
+             const int imp_method,
+             const int cg_guess,
+             const int cg_prec,
+             const int cg_method,
+             const real_t cg_tol,
+             const int cg_schedule,
+             const real_t cg_acc,
              const real_t threshold)
 {
   
   startTimer(sp2LoopTimer);
 
-  const int method = 0;
-
   startTimer(allocTimer);
   int N = bml_get_N(h_bml);
   int M = bml_get_M(h_bml);
@@ -53,125 +313,471 @@ void implicit_recursiveLoops(const bml_matrix_t* h_bml,
   bml_matrix_t* p2_bml = bml_zero_matrix(bml_type, precision, N, M, dmode);
   bml_matrix_t* x_bml = bml_zero_matrix(bml_type, precision, N, M, dmode);
   bml_matrix_t* a_bml = bml_zero_matrix(bml_type, precision, N, M, dmode);
-  bml_matrix_t* ai_bml;
-  bml_matrix_t* I_bml;
-  if (method == 1) { 
+  bml_matrix_t* z_bml = bml_zero_matrix(bml_type, precision, N, M, dmode);
+  bml_matrix_t* ai_bml = NULL;
+  bml_matrix_t* dinv_bml = NULL;
+  bml_matrix_t* m_bml = NULL;
+  if (imp_method != 0) { 
+     // First Newton-Schulz guess, see newtonSchulz
      ai_bml = bml_identity_matrix(bml_type, precision, N, M, dmode); 
-     I_bml = bml_identity_matrix(bml_type, precision, N, M, dmode);
+     bml_scale_add_identity(ai_bml, ZERO, 4.0 / 3.0, threshold);
+  }
+  if (cg_prec > 0) {
+     dinv_bml = bml_zero_matrix(bml_type, precision, N, M, dmode);
+     m_bml = (cg_prec == 2) ? 
+       bml_zero_matrix(bml_type, precision, N, M, dmode) : dinv_bml;
   }
   stopTimer(allocTimer);
 
   const int exp_order = pow(2,rec_steps);
   const real_t cnst = beta/(4*exp_order);
-  const real_t cg_tol = 0.0001;
-  int i,j;
-  real_t norm;
+  const real_t ns_tol = 0.01;
+  int nfail = 0;
+  int nsteps_ns = 0;
+  real_t cgCost = ZERO;
+  real_t nsCost = ZERO;
+  int* cgIters = calloc(rec_steps, sizeof(int));
+  real_t errBound = ZERO;
 
   // Normalize hamiltonian 
   bml_copy(h_bml, p_bml);
   normalize(p_bml, cnst, mu);
 
+  // Clear the lap timers used for the cost estimates
+  getElapsedTime(cgTimer);
+  getElapsedTime(nsiterTimer);
 
-     for (i=1; i <= rec_steps; i++) {
+     for (int i = 1; i <= rec_steps; i++) {
     
        // Set up linear system 
        startTimer(x2Timer);
-       bml_multiply_x2(p_bml, p2_bml, threshold);
+       real_t* trace = bml_multiply_x2(p_bml, p2_bml, threshold);
        stopTimer(x2Timer);
+       real_t trY2 = trace[1] - trace[0] + 0.25 * N;
+       bml_free_memory(trace);
        bml_copy(p2_bml, a_bml);
        bml_add(a_bml, p_bml, ONE, MINUS_ONE, threshold);
        bml_scale_add_identity(a_bml, TWO, ONE, threshold);
+
+       int useNS = (imp_method == 1);
+       if (imp_method == 2)
+	       useNS = (i == 2) || (i > 2 && nsCost < cgCost);
    
-       // Newton-Schulz-method
-       if (method == 1) {
-	      
+       if (useNS) {
+		   // Newton-Schulz method
 		   startTimer(nsiterTimer);
-		   j = 1;
-		   norm = 1.0;
-		   // Find inverse with Newton-Schulz iteration
-		   while(norm > 0.01)    {
-			   // First time use Conjugate Gradient for inverse starting guess 
-			   if (i == 1 && j == 1) { 
-				   startTimer(inverseTimer);
-				   conjugateGradient(a_bml, I_bml, ai_bml, x_bml, xtmp_bml, 0.9, threshold);
-				   stopTimer(inverseTimer);
-			   }
-			   bml_copy(ai_bml, xtmp_bml);
-            		   bml_multiply(a_bml, ai_bml, x_bml, ONE, ZERO, threshold);
-                           bml_scale_add_identity(x_bml, MINUS_ONE, ONE, threshold);
-                           norm = bml_fnorm(x_bml);
-			   bml_multiply(xtmp_bml, x_bml, ai_bml, ONE, ONE, threshold);
-			   j++;
-		   }
+		   int j = newtonSchulz(a_bml, ai_bml, x_bml, xtmp_bml, ns_tol, threshold);
+
 	       // Get next density matrix  
+	       startTimer(mmTimer);
 	       bml_multiply(ai_bml, p2_bml, p_bml, ONE, ZERO, threshold);
+	       stopTimer(mmTimer);
 	       stopTimer(nsiterTimer);
+	       nsCost = getElapsedTime(nsiterTimer);
+	       nsteps_ns++;
+	       cgIters[i-1] = -1;
+
+	       // P = Ai P2 is off by (Ai - A^-1) P2 = A^-1 (I - A Ai) P2
+	       errBound += propagatedError(i, rec_steps, TWO * ns_tol);
+
+	       if (bml_printRank() && debug_i == 1)
+		       printf("Number of Newton-Schulz iterations: %d\n", j);
 	}
-	// Conjugate gradient method
 	else {
-	       conjugateGradient(a_bml, p2_bml, p_bml, x_bml, xtmp_bml, cg_tol, threshold);
+	       // Conjugate gradient method, with extrapolated starting guess
+	       if (cg_guess == 1) {
+		       real_t b = TWO / (ONE + 4.0 * trY2 / N);
+		       bml_scale_add_identity(p_bml, b, HALF * (ONE - b), threshold);
+	       }
+
+	       if (cg_prec > 0)
+		       setPreconditioner(a_bml, dinv_bml, m_bml, xtmp_bml, cg_prec, threshold);
+
+	       real_t tol = (cg_schedule == 1) ? 
+		       stepTolerance(i, rec_steps, cg_acc) : cg_tol;
+
+	       int converged;
+	       if (cg_method == 1)
+		       converged = pipelinedConjugateGradient(a_bml, p2_bml, p_bml, x_bml, 
+		         xtmp_bml, m_bml, tol, &cgIters[i-1], threshold);
+	       else
+		       converged = conjugateGradient(a_bml, p2_bml, p_bml, x_bml, xtmp_bml, 
+		         m_bml, z_bml, tol, &cgIters[i-1], threshold);
+
+	       if (!converged) {
+		       // Restart on the residual equation A E = R, with P += E
+		       bml_scale_inplace(&ZERO, z_bml);
+		       if (!conjugateGradient(a_bml, p2_bml, z_bml, x_bml, xtmp_bml, 
+		             NULL, NULL, tol, &cgIters[i-1], threshold))
+			       nfail++;
+		       bml_add(p_bml, z_bml, ONE, ONE, threshold);
+	       }
+	       cgCost = getElapsedTime(cgTimer);
+
+	       // P2 holds the final residual
+	       errBound += propagatedError(i, rec_steps, 
+		 TWO * sqrt(bml_sum_squares(p2_bml)));
 	}
      }
    
- // bml_print_bml_matrix(p_bml, 0, 10, 0, 10);
   bml_deallocate(&a_bml);
   bml_deallocate(&p2_bml);
   bml_deallocate(&xtmp_bml);
   bml_deallocate(&x_bml);
-  if (method == 1) { 
-     bml_deallocate(&ai_bml);
-     bml_deallocate(&I_bml);
-  }
+  bml_deallocate(&z_bml);
+  if (imp_method != 0) bml_deallocate(&ai_bml);
+  if (cg_prec == 2) bml_deallocate(&m_bml);
+  if (cg_prec > 0) bml_deallocate(&dinv_bml);
   stopTimer(sp2LoopTimer);	 
+
+  int total = 0;
+  for (int i = 0; i < rec_steps; i++)
+    total += MAX(cgIters[i], 0);
+
+  // Every solve met cg_tol from its starting guess, so P was never
+  // updated and still holds X0
+  if (total == 0 && nsteps_ns == 0)
+    nfail = rec_steps;
+
+  if (bml_printRank())
+  {
+    printf("CG iterations per step:");
+    for (int i = 0; i < rec_steps; i++)
+    {
+      if (cgIters[i] < 0) 
+        printf(" -");
+      else 
+        printf(" %d", cgIters[i]);
+    }
+    printf("\nTotal CG iterations = %d\n", total);
+    if (total == 0 && nsteps_ns == 0)
+      printf("Error: no CG iterations in any recursion step, the residual "
+        "of X0 is already below cg_tol = %lg; lower cg_tol or nsteps\n", cg_tol);
+    if (imp_method != 0)
+      printf("Newton-Schulz used in %d of %d recursion steps\n", 
+        nsteps_ns, rec_steps);
+    if (nfail > 0)
+      printf("Conjugate gradient not converged in %d of %d recursion steps\n",
+        nfail, rec_steps);
+    printf("Bound on the error in P from the solves = %lg\n", errBound);
+  }
+
+  free(cgIters);
+
+  return nfail;
 }
  
 
+/// \details
+/// Save the CG iterate before the last update P += alpha D,
+/// R -= alpha S in pbest and rbest, allocated on first use.
+static void saveIterate(const bml_matrix_t* p_bml,
+                        const bml_matrix_t* r_bml,
+                        const bml_matrix_t* d_bml,
+                        const bml_matrix_t* s_bml,
+                        const real_t alpha,
+                        bml_matrix_t** pbest_bml,
+                        bml_matrix_t** rbest_bml,
+                        const real_t threshold)
+{
+  if (*pbest_bml == NULL) {
+    *pbest_bml = bml_copy_new(p_bml);
+    *rbest_bml = bml_copy_new(r_bml);
+  }
+  else {
+    bml_copy(p_bml, *pbest_bml);
+    bml_copy(r_bml, *rbest_bml);
+  }
+  bml_add(*pbest_bml, d_bml, ONE, -alpha, threshold);
+  bml_add(*rbest_bml, s_bml, ONE, alpha, threshold);
+}
 
-void conjugateGradient(const bml_matrix_t* A_bml, 
-	               bml_matrix_t* p2_bml, 
-	               bml_matrix_t* p_bml, 
-                       bml_matrix_t* d_bml,
-                       bml_matrix_t* wtmp_bml,
-	               const real_t cg_tol,
-	               const real_t threshold) {
+/// \details
+/// Solve A P = P2 by (preconditioned) conjugate gradient, starting
+/// from the guess in p_bml. P2 is overwritten by the residual. m_bml is
+/// the preconditioner, or NULL for none, in which case z_bml is not
+/// used. Stops once ||R||_F^2 <= cg_tol, after CG_MAX_ITER iterations,
+/// or after CG_STALL iterations without a new smallest ||R||_F^2, in
+/// which case P and R are set back to the iterate with the smallest
+/// residual. A tolerance below the thresholding noise otherwise lets
+/// the residual grow without bound. Returns 1 if converged and 0
+/// otherwise. The number of iterations is added to *iters.
+int conjugateGradient(const bml_matrix_t* A_bml, 
+	              bml_matrix_t* p2_bml, 
+	              bml_matrix_t* p_bml, 
+                      bml_matrix_t* d_bml,
+                      bml_matrix_t* wtmp_bml,
+                      const bml_matrix_t* m_bml,
+                      bml_matrix_t* z_bml,
+	              const real_t cg_tol,
+                      int* iters,
+	              const real_t threshold) {
 
   startTimer(cgTimer);
   
-  real_t alpha, beta, r_norm_new, r_norm_old, trace;
+  real_t alpha, beta, r_norm, rz_new;
+  real_t rz_old = ONE;
   int k = 0;
+  int nstall = 0;
+
+  // Iterate with the smallest residual, saved once the residual stops
+  // decreasing
+  bml_matrix_t* pbest_bml = NULL;
+  bml_matrix_t* rbest_bml = NULL;
 
   startTimer(mmTimer);
   bml_multiply(A_bml, p_bml, p2_bml, MINUS_ONE, ONE, threshold);
   stopTimer(mmTimer);
-  r_norm_old = bml_sum_squares(p2_bml);
-  r_norm_new = r_norm_old;
+  r_norm = bml_sum_squares(p2_bml);
+  real_t r_min = r_norm;
+
+  // Z = M R, or Z = R without preconditioner
+  const bml_matrix_t* r_bml = p2_bml;
+  if (m_bml != NULL) {
+    startTimer(mmTimer);
+    bml_multiply(m_bml, p2_bml, z_bml, ONE, ZERO, threshold);
+    stopTimer(mmTimer);
+    r_bml = z_bml;
+    rz_new = bml_trace_mult(p2_bml, z_bml);
+  }
+  else {
+    rz_new = r_norm;
+  }
   
-  while (cg_tol < r_norm_new) {
+  while (cg_tol < r_norm && k < CG_MAX_ITER) {
     
-    //printf("%lf\n", r_norm_new);
+    //printf("%lf\n", r_norm);
     k++;
     if (k == 1) {
-      bml_copy(p2_bml, d_bml);
+      bml_copy(r_bml, d_bml);
     }
     else {
-      beta = r_norm_new/r_norm_old;
-      bml_add(d_bml, p2_bml, beta, ONE, threshold);
+      beta = rz_new/rz_old;
+      bml_add(d_bml, r_bml, beta, ONE, threshold);
     }
     startTimer(mmTimer);
     bml_multiply_AB(A_bml, d_bml, wtmp_bml, threshold);
     stopTimer(mmTimer);
-    alpha = r_norm_new/bml_trace_mult(d_bml, wtmp_bml);
+    // Direction lost to thresholding, no further progress possible
+    real_t dw = bml_trace_mult(d_bml, wtmp_bml);
+    if (dw <= ZERO) break;
+    alpha = rz_new/dw;
     bml_add(p_bml, d_bml, ONE, alpha, threshold);
     bml_add(p2_bml, wtmp_bml, ONE, -alpha, threshold);
-    r_norm_old = r_norm_new;
-    r_norm_new = bml_sum_squares(p2_bml);
-    if (k > 100) {
+    r_norm = bml_sum_squares(p2_bml);
+    rz_old = rz_new;
+    if (r_norm < r_min) {
+      r_min = r_norm;
+      nstall = 0;
+    }
+    else {
+      // The previous iterate is the best one so far
+      if (nstall++ == 0)
+        saveIterate(p_bml, p2_bml, d_bml, wtmp_bml, alpha, &pbest_bml, 
+          &rbest_bml, threshold);
+      if (nstall >= CG_STALL) {
+        bml_copy(pbest_bml, p_bml);
+        bml_copy(rbest_bml, p2_bml);
+        r_norm = r_min;
+        break;
+      }
+    }
+    if (m_bml != NULL) {
+      startTimer(mmTimer);
+      bml_multiply(m_bml, p2_bml, z_bml, ONE, ZERO, threshold);
+      stopTimer(mmTimer);
+      rz_new = bml_trace_mult(p2_bml, z_bml);
+    }
+    else {
+      rz_new = r_norm;
+    }
+  }
+  if (bml_printRank() && debug_i == 1)
+  {
+    if (cg_tol < r_norm)
       printf("Conjugate gradient not converging\n");
-      exit(1);
+    printf("Number of CG iterations: %d\n", k);
+  }
+  *iters += k;
+  if (pbest_bml != NULL) {
+    bml_deallocate(&pbest_bml);
+    bml_deallocate(&rbest_bml);
+  }
+  stopTimer(cgTimer);
+
+  return (r_norm <= cg_tol);
+}
+
+
+/// \details
+/// Solve A P = P2 by pipelined conjugate gradient (Ghysels and
+/// Vanroose), preconditioned by m_bml unless it is NULL. Arguments and
+/// return value, and the stopping rules, are as for conjugateGradient.
+///
+/// The recurrences are rearranged so that the inner products of an
+/// iteration, (R,R), (R,U) and (W,U) with U = M R and W = A U, are
+/// available at the same point. They are reduced together in one
+/// non-blocking collective that overlaps the products M W and A M W.
+/// This replaces two blocking reductions per iteration with one hidden
+/// one, at the cost of more work matrices and one extra multiply for
+/// the final iteration. Without preconditioner U = R, and M W and
+/// M S are W and S themselves.
+int pipelinedConjugateGradient(const bml_matrix_t* A_bml, 
+                               bml_matrix_t* p2_bml, 
+                               bml_matrix_t* p_bml, 
+                               bml_matrix_t* d_bml,
+                               bml_matrix_t* wtmp_bml,
+                               const bml_matrix_t* m_bml,
+                               const real_t cg_tol,
+                               int* iters,
+                               const real_t threshold)
+{
+  startTimer(cgTimer);
+
+  // R in p2, S = A D in wtmp, plus W = A U, Q = A M W and Z = A M S
+  bml_matrix_t* w_bml = bml_copy_new(p2_bml);
+  bml_matrix_t* q_bml = bml_copy_new(p2_bml);
+  bml_matrix_t* z_bml = bml_copy_new(p2_bml);
+
+  // U = M R, MW = M W and MS = M S
+  bml_matrix_t* u_bml = p2_bml;
+  bml_matrix_t* mw_bml = w_bml;
+  bml_matrix_t* ms_bml = wtmp_bml;
+  if (m_bml != NULL) {
+    u_bml = bml_copy_new(p2_bml);
+    mw_bml = bml_copy_new(p2_bml);
+    ms_bml = bml_copy_new(p2_bml);
+  }
+
+  real_t alpha = ONE;
+  real_t beta = ZERO;
+  real_t r_norm = ZERO;
+  real_t r_min = ZERO;
+  real_t gamma = ZERO;
+  real_t gammaOld = ZERO;
+  real_t sLocal[3], sGlobal[3];
+  int k = 0;
+  int nstall = 0;
+  bml_matrix_t* pbest_bml = NULL;
+  bml_matrix_t* rbest_bml = NULL;
+
+  startTimer(mmTimer);
+  bml_multiply(A_bml, p_bml, p2_bml, MINUS_ONE, ONE, threshold);
+  if (m_bml != NULL)
+    bml_multiply(m_bml, p2_bml, u_bml, ONE, ZERO, threshold);
+  bml_multiply_AB(A_bml, u_bml, w_bml, threshold);
+  stopTimer(mmTimer);
+
+  while (1) {
+
+    // (R,R), gamma = (R,U) and delta = (W,U), reduced while M W and
+    // Q = A M W are formed
+    sLocal[0] = bml_sum_squares(p2_bml);
+    sLocal[1] = (m_bml != NULL) ? bml_trace_mult(p2_bml, u_bml) : sLocal[0];
+    sLocal[2] = bml_trace_mult(w_bml, u_bml);
+    for (int j = 0; j < 3; j++)
+      sGlobal[j] = sLocal[j];
+#ifdef DO_MPI
+    int rind = -1;
+    if (bml_getNRanks() > 1)
+    {
+      startTimer(reduceCommTimer);
+      rind = iaddRealParallel(sLocal, sGlobal, 3);
+      stopTimer(reduceCommTimer);
     }
+#endif
+
+    startTimer(mmTimer);
+    if (m_bml != NULL)
+      bml_multiply(m_bml, w_bml, mw_bml, ONE, ZERO, threshold);
+    bml_multiply_AB(A_bml, mw_bml, q_bml, threshold);
+    stopTimer(mmTimer);
+
+#ifdef DO_MPI
+    if (rind >= 0)
+    {
+      startTimer(reduceCommTimer);
+      waitIreduce(rind);
+      stopTimer(reduceCommTimer);
+      collectCounter(reduceCounter, 3 * sizeof(real_t));
+    }
+#endif
+
+    r_norm = sGlobal[0];
+    gammaOld = gamma;
+    gamma = sGlobal[1];
+    real_t delta = sGlobal[2];
+
+    if (r_norm <= cg_tol || k >= CG_MAX_ITER) break;
+    if (k == 0 || r_norm < r_min) {
+      r_min = r_norm;
+      nstall = 0;
+    }
+    else {
+      // The previous iterate is the best one so far
+      if (nstall++ == 0)
+        saveIterate(p_bml, p2_bml, d_bml, wtmp_bml, alpha, &pbest_bml, 
+          &rbest_bml, threshold);
+      if (nstall >= CG_STALL) {
+        bml_copy(pbest_bml, p_bml);
+        bml_copy(rbest_bml, p2_bml);
+        r_norm = r_min;
+        break;
+      }
+    }
+
+    if (k > 0)
+      beta = gamma / gammaOld;
+
+    // Direction lost to thresholding, no further progress possible
+    real_t denom = (k == 0) ? delta : delta - beta * gamma / alpha;
+    if (denom <= ZERO) break;
+    alpha = gamma / denom;
+
+    if (k == 0) {
+      bml_copy(q_bml, z_bml);
+      if (m_bml != NULL) bml_copy(mw_bml, ms_bml);
+      bml_copy(w_bml, wtmp_bml);
+      bml_copy(u_bml, d_bml);
+    }
+    else {
+      bml_add(z_bml, q_bml, beta, ONE, threshold);
+      if (m_bml != NULL) bml_add(ms_bml, mw_bml, beta, ONE, threshold);
+      bml_add(wtmp_bml, w_bml, beta, ONE, threshold);
+      bml_add(d_bml, u_bml, beta, ONE, threshold);
+    }
+    k++;
+
+    bml_add(p_bml, d_bml, ONE, alpha, threshold);
+    bml_add(p2_bml, wtmp_bml, ONE, -alpha, threshold);
+    if (m_bml != NULL) bml_add(u_bml, ms_bml, ONE, -alpha, threshold);
+    bml_add(w_bml, z_bml, ONE, -alpha, threshold);
   }
-  printf("Number of CG iterations: %d\n", k);
+
+  if (bml_printRank() && debug_i == 1)
+  {
+    if (cg_tol < r_norm)
+      printf("Conjugate gradient not converging\n");
+    printf("Number of CG iterations: %d\n", k);
+  }
+  *iters += k;
+
+  bml_deallocate(&w_bml);
+  bml_deallocate(&q_bml);
+  bml_deallocate(&z_bml);
+  if (m_bml != NULL) {
+    bml_deallocate(&u_bml);
+    bml_deallocate(&mw_bml);
+    bml_deallocate(&ms_bml);
+  }
+  if (pbest_bml != NULL) {
+    bml_deallocate(&pbest_bml);
+    bml_deallocate(&rbest_bml);
+  }
+
   stopTimer(cgTimer);
+
+  return (r_norm <= cg_tol);
 }
 
 
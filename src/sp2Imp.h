@@ -12,20 +12,48 @@
 
 void normalize(bml_matrix_t* h_bml, const real_t cnst, const real_t mu);
 
-void implicit_recursiveLoops(const bml_matrix_t* h_bml, 
-             bml_matrix_t* p_bml,
-	     const real_t beta,
-             const real_t mu, 
-             const int rec_steps, 
-             const real_t threshold);
-
-void conjugateGradient(const bml_matrix_t* A_bml,
-                       bml_matrix_t* p_bml,
-                       bml_matrix_t* p2_bml, 
-	               bml_matrix_t* d_bml,
-		       bml_matrix_t* wtmp_bml,
-                       const real_t cg_tol,
-                       const real_t threshold); 
+int recursionDepth(const bml_matrix_t* h_bml,
+                   const real_t nocc,
+                   const real_t beta,
+                   const real_t mu,
+                   const real_t occErrLimit,
+                   const real_t cg_tol,
+                   const real_t threshold);
+
+int implicit_recursiveLoops(const bml_matrix_t* h_bml, 
+                            bml_matrix_t* p_bml,
+                            const real_t beta,
+                            const real_t mu, 
+                            const int rec_steps, 
+                            const int imp_method,
+                            const int cg_guess,
+                            const int cg_prec,
+                            const int cg_method,
+                            const real_t cg_tol,
+                            const int cg_schedule,
+                            const real_t cg_acc,
+                            const real_t threshold);
+
+int conjugateGradient(const bml_matrix_t* A_bml,
+                      bml_matrix_t* p2_bml,
+                      bml_matrix_t* p_bml, 
+	              bml_matrix_t* d_bml,
+		      bml_matrix_t* wtmp_bml,
+                      const bml_matrix_t* m_bml,
+                      bml_matrix_t* z_bml,
+                      const real_t cg_tol,
+                      int* iters,
+                      const real_t threshold); 
+
+int pipelinedConjugateGradient(const bml_matrix_t* A_bml,
+                               bml_matrix_t* p2_bml,
+                               bml_matrix_t* p_bml, 
+                               bml_matrix_t* d_bml,
+                               bml_matrix_t* wtmp_bml,
+                               const bml_matrix_t* m_bml,
+                               const real_t cg_tol,
+                               int* iters,
+                               const real_t threshold);
 
 
 
@@ -0,0 +1,281 @@
+/// \file
+/// Self-consistent charge loop with a low-rank kernel.
+///
+/// A synthetic charge dependent Hamiltonian
+///
+///   H(q) = H0 + U * diag(q - q0)
+///
+/// with orbital charges q = diag(P[H(q)]) and the neutral reference
+/// q0 = 2*nocc/N, stands in for the self-consistent charge update of a
+/// tight-binding code. The residual r(q) = diag(P[H(q)]) - q vanishes
+/// at self-consistency.
+///
+/// Linear mixing (scfMethod 0) steps q by SCF_MIX*r. The kernel
+/// (scfMethod 1) is a low-rank approximation of the inverse Jacobian
+/// of r. The last kernelRank residuals are orthonormalized into V, and
+/// the Jacobian on V comes from one batched response pass:
+/// J*v = diag(P1) for H1 = U*diag(v). The step is the Newton step
+/// restricted to V,
+///
+///   dq = V*c,  c = argmin |r + (J - I)*V*c|
+///
+/// so each cycle costs one SP2 solve and one response pass, with
+/// the X0 squarings of the pass shared by the kernelRank directions.
+/// The pass repeats the X0 squarings of the solve it follows (the +1
+/// per step in the response multiply count), since sp2Loop keeps only
+/// the final X.
+
+#ifdef SP2_KERNEL
+
+#include "bml.h"
+
+#include "sp2Kernel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "performance.h"
+#include "parallel.h"
+#include "constants.h"
+#include "sp2Response.h"
+#include "csrMatrix.h"
+
+/// Maximum number of SCF cycles
+#define SCF_MAX_ITER 100
+/// Linear mixing coefficient
+#define SCF_MIX 0.1
+
+/// \details
+/// H = H0 + U * diag(q - q0)
+static void chargeHamiltonian(const bml_matrix_t* h0_bml,
+                              bml_matrix_t* h_bml,
+                              const real_t* q,
+                              const real_t q0,
+                              const real_t hubbardU)
+{
+  int N = bml_get_N(h0_bml);
+
+  bml_copy(h0_bml, h_bml);
+  real_t* diag = bml_get_diagonal(h_bml);
+  for (int i = 0; i < N; i++)
+    diag[i] += hubbardU * (q[i] - q0);
+  bml_set_diagonal(h_bml, diag, ZERO);
+  bml_free_memory(diag);
+}
+
+/// \details
+/// Orthonormalize the nhist vectors in hist into v by modified
+/// Gram-Schmidt, dropping those that are nearly dependent. Returns the
+/// number of vectors kept.
+static int orthonormalize(const int n,
+                          const int nhist,
+                          real_t** hist,
+                          real_t** v)
+{
+  int nv = 0;
+
+  for (int k = 0; k < nhist; k++)
+  {
+    real_t norm0 = sqrt(csrDot(n, hist[k], hist[k]));
+    for (int i = 0; i < n; i++)
+      v[nv][i] = hist[k][i];
+
+    for (int l = 0; l < nv; l++)
+    {
+      real_t c = csrDot(n, v[l], v[nv]);
+      for (int i = 0; i < n; i++)
+        v[nv][i] -= c * v[l][i];
+    }
+
+    real_t norm = sqrt(csrDot(n, v[nv], v[nv]));
+    if (norm > 1.0E-8 * norm0)
+    {
+      for (int i = 0; i < n; i++)
+        v[nv][i] /= norm;
+      nv++;
+    }
+  }
+
+  return nv;
+}
+
+/// \details
+/// Least squares solution c of f*c = -r for the nv columns f[k], by
+/// modified Gram-Schmidt QR. f is overwritten with Q.
+static void leastSquares(const int n,
+                         const int nv,
+                         real_t** f,
+                         const real_t* r,
+                         real_t* c)
+{
+  real_t* rr = calloc(nv * nv, sizeof(real_t));
+
+  for (int k = 0; k < nv; k++)
+  {
+    for (int l = 0; l < k; l++)
+    {
+      rr[l*nv+k] = csrDot(n, f[l], f[k]);
+      for (int i = 0; i < n; i++)
+        f[k][i] -= rr[l*nv+k] * f[l][i];
+    }
+    rr[k*nv+k] = sqrt(csrDot(n, f[k], f[k]));
+    for (int i = 0; i < n; i++)
+      f[k][i] /= rr[k*nv+k];
+  }
+
+  // R*c = -Q^T*r
+  for (int k = nv - 1; k >= 0; k--)
+  {
+    c[k] = -csrDot(n, f[k], r);
+    for (int l = k + 1; l < nv; l++)
+      c[k] -= rr[k*nv+l] * c[l];
+    c[k] /= rr[k*nv+k];
+  }
+
+  free(rr);
+}
+
+/// \details
+/// Self-consistent charge loop on H0, leaving the converged density
+/// matrix in rho_bml. method selects linear mixing (0) or the rank
+/// kernel (1). Each cycle runs sp2Loop on H(q), recording the branch
+/// sequence in seq for the response pass. Returns the number of SP2
+/// solves, and prints them with the multiplies spent in SP2 and in
+/// the response passes.
+int kernelScf(const bml_matrix_t* h0_bml,
+              bml_matrix_t* rho_bml,
+              const real_t nocc,
+              const int method,
+              const int rank,
+              const real_t hubbardU,
+              const real_t scfTol,
+              Sp2Sequence* seq,
+              const real_t threshold)
+{
+  int N = bml_get_N(h0_bml);
+  int M = bml_get_M(h0_bml);
+  bml_matrix_type_t matrix_type = bml_get_type(h0_bml);
+  bml_matrix_precision_t precision = bml_get_precision(h0_bml);
+  bml_distribution_mode_t dmode = bml_get_distribution_mode(h0_bml);
+
+  int nkeep = MAX(rank, 1);
+  real_t q0 = TWO * nocc / N;
+  real_t* q = malloc(N * sizeof(real_t));
+  real_t* r = malloc(N * sizeof(real_t));
+  real_t* c = malloc(nkeep * sizeof(real_t));
+  real_t** hist = malloc(nkeep * sizeof(real_t*));
+  real_t** v = malloc(nkeep * sizeof(real_t*));
+  bml_matrix_t** pert_bml = malloc(nkeep * sizeof(bml_matrix_t*));
+  bml_matrix_t** resp_bml = malloc(nkeep * sizeof(bml_matrix_t*));
+  for (int k = 0; k < nkeep; k++)
+  {
+    hist[k] = malloc(N * sizeof(real_t));
+    v[k] = malloc(N * sizeof(real_t));
+    pert_bml[k] = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+    resp_bml[k] = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+  }
+  bml_matrix_t* h_bml = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+
+  for (int i = 0; i < N; i++)
+    q[i] = q0;
+
+  int nsolve = 0;
+  int nhist = 0;
+  int sp2Mult = 0;
+  int respMult = 0;
+  real_t rnorm = ONE;
+
+  for (int cycle = 0; cycle < SCF_MAX_ITER; cycle++)
+  {
+    chargeHamiltonian(h0_bml, h_bml, q, q0, hubbardU);
+    sp2Mult += sp2Loop(h_bml, rho_bml, nocc, minsp2iter_i, maxsp2iter_i, 
+      idemTol_i, threshold, seq);
+    nsolve++;
+
+    real_t* qOut = bml_get_diagonal(rho_bml);
+    for (int i = 0; i < N; i++)
+      r[i] = qOut[i] - q[i];
+    bml_free_memory(qOut);
+
+    rnorm = sqrt(csrDot(N, r, r) / N);
+    if (bml_printRank())
+      printf("SCF cycle %d: rms charge residual = %e\n", cycle, rnorm);
+    if (rnorm < scfTol) break;
+
+    if (method == 0)
+    {
+      for (int i = 0; i < N; i++)
+        q[i] += SCF_MIX * r[i];
+      continue;
+    }
+
+    // Newest residual first, oldest dropped
+    real_t* last = hist[nkeep-1];
+    for (int k = nkeep - 1; k > 0; k--)
+      hist[k] = hist[k-1];
+    hist[0] = last;
+    for (int i = 0; i < N; i++)
+      hist[0][i] = r[i];
+    nhist = MIN(nhist + 1, nkeep);
+
+    int nv = orthonormalize(N, nhist, hist, v);
+
+    // Jacobian on V from one response pass, then f_k = (J - I)*v_k
+    for (int k = 0; k < nv; k++)
+    {
+      for (int i = 0; i < N; i++)
+        r[i] = hubbardU * v[k][i];
+      bml_set_diagonal(pert_bml[k], r, ZERO);
+    }
+    for (int i = 0; i < N; i++)
+      r[i] = hist[0][i];
+    responseLoop(h_bml, pert_bml, resp_bml, nv, seq, 0, threshold);
+    respMult += seq->nsteps * (nv + 1);
+
+    real_t** f = malloc(nv * sizeof(real_t*));
+    for (int k = 0; k < nv; k++)
+    {
+      f[k] = bml_get_diagonal(resp_bml[k]);
+      for (int i = 0; i < N; i++)
+        f[k][i] -= v[k][i];
+    }
+
+    leastSquares(N, nv, f, r, c);
+
+    for (int k = 0; k < nv; k++)
+    {
+      for (int i = 0; i < N; i++)
+        q[i] += c[k] * v[k][i];
+      bml_free_memory(f[k]);
+    }
+    free(f);
+  }
+
+  if (bml_printRank())
+  {
+    printf("\nSCF %s after %d SP2 solves (%s)\n", 
+      (rnorm < scfTol) ? "converged" : "not converged", nsolve,
+      (method == 0) ? "linear mixing" : "kernel");
+    printf("Multiplies: SP2 = %d  response = %d  total = %d\n", 
+      sp2Mult, respMult, sp2Mult + respMult);
+  }
+
+  for (int k = 0; k < nkeep; k++)
+  {
+    free(hist[k]);
+    free(v[k]);
+  }
+  free(hist);
+  free(v);
+  free(q);
+  free(r);
+  free(c);
+  destroyMatrices(&pert_bml, nkeep);
+  destroyMatrices(&resp_bml, nkeep);
+  bml_deallocate(&h_bml);
+
+  return nsolve;
+}
+
+#endif
@@ -0,0 +1,24 @@
+/// \file
+/// Self-consistent charge loop functions.
+
+#ifndef __SP2KERNEL_H
+#define __SP2KERNEL_H
+
+#include "bml.h"
+
+#include <stdio.h>
+
+#include "mytype.h"
+#include "sp2Basic.h"
+
+int kernelScf(const bml_matrix_t* h0_bml,
+              bml_matrix_t* rho_bml,
+              const real_t nocc,
+              const int method,
+              const int rank,
+              const real_t hubbardU,
+              const real_t scfTol,
+              Sp2Sequence* seq,
+              const real_t threshold);
+
+#endif
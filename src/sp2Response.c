@@ -0,0 +1,219 @@
+/// \file
+/// SP2 density matrix response.
+///
+/// First order response P1 = dP/dlambda of the density matrix to a
+/// perturbation H + lambda*H1, by differentiating each SP2 step
+/// (quantum perturbation theory in the SP2 form of Niklasson and
+/// Challacombe):
+///
+///   X0 = X0^2              X1 = X0*X1 + X1*X0
+///   X0 = 2*X0 - X0^2       X1 = 2*X1 - (X0*X1 + X1*X0)
+///
+/// starting from X1 = -H1/(emax - emin). The branch sequence and bounds
+/// are the ones recorded by the ground state sp2Loop, so the response
+/// pass needs no traces or reductions.
+///
+/// All perturbations are carried through the same pass. The squaring
+/// of X0 is shared, and since X0 and X1 are symmetric,
+/// X1*X0 = (X0*X1)^T, so each perturbation costs one multiply per
+/// step. Three field directions take 4 multiplies per step instead of
+/// the 9 of three separate response runs.
+
+#ifdef SP2_RESPONSE
+
+#include "bml.h"
+
+#include "sp2Response.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "performance.h"
+#include "parallel.h"
+#include "constants.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/// \details
+/// Perturbations H1_k, k = 0..nresp-1, read from the files
+/// pertName.k.mtx. Without pertName, stand-ins for the dipole matrices
+/// of a field are generated: the diagonal potentials
+/// cos(pi*(k+1)*(i+1/2)/N), of which the first is a ramp along the
+/// orbital index.
+bml_matrix_t** responsePerturbations(const bml_matrix_t* h_bml,
+                                     const int nresp,
+                                     const char* pertName)
+{
+  int N = bml_get_N(h_bml);
+  int M = bml_get_M(h_bml);
+  bml_matrix_type_t matrix_type = bml_get_type(h_bml);
+  bml_matrix_precision_t precision = bml_get_precision(h_bml);
+  bml_distribution_mode_t dmode = bml_get_distribution_mode(h_bml);
+
+  bml_matrix_t** pert_bml = malloc(nresp * sizeof(bml_matrix_t*));
+  real_t* diag = malloc(N * sizeof(real_t));
+  char fileName[1100];
+
+  for (int k = 0; k < nresp; k++)
+  {
+    pert_bml[k] = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+    if (strlen(pertName) > 0)
+    {
+      sprintf(fileName, "%s.%d.mtx", pertName, k);
+      startTimer(readhTimer);
+      bml_read_bml_matrix(pert_bml[k], fileName);
+      stopTimer(readhTimer);
+    }
+    else
+    {
+      for (int i = 0; i < N; i++)
+        diag[i] = cos(M_PI * (k + 1) * (i + HALF) / N);
+      bml_set_diagonal(pert_bml[k], diag, ZERO);
+    }
+  }
+
+  free(diag);
+
+  return pert_bml;
+}
+
+/// \details
+/// Response of the density matrix to nresp perturbations, following
+/// the branch sequence seq recorded by sp2Loop for h_bml. resp_bml[k]
+/// is set to 2*X1 for pert_bml[k], matching the factor 2 of rho.
+/// With report = 1, prints Tr(P1_k) (zero for a fixed number of
+/// electrons) and the response matrix Tr(P1_k*H1_l), e.g. the
+/// polarizability for dipole perturbations.
+void responseLoop(const bml_matrix_t* h_bml,
+                  bml_matrix_t** pert_bml,
+                  bml_matrix_t** resp_bml,
+                  const int nresp,
+                  const Sp2Sequence* seq,
+                  const int report,
+                  const real_t threshold)
+{
+  int N = bml_get_N(h_bml);
+  int M = bml_get_M(h_bml);
+  bml_matrix_type_t matrix_type = bml_get_type(h_bml);
+  bml_matrix_precision_t precision = bml_get_precision(h_bml);
+  bml_distribution_mode_t dmode = bml_get_distribution_mode(h_bml);
+
+  int nmult = 0;
+
+  startTimer(responseTimer);
+
+  // X0 and X1_k from the recorded normalization
+  startTimer(normTimer);
+  bml_matrix_t* x_bml = bml_copy_new(h_bml);
+  normalizeBounds(x_bml, seq->emin, seq->emax);
+  real_t scale = MINUS_ONE / (seq->emax - seq->emin);
+  for (int k = 0; k < nresp; k++)
+  {
+    bml_copy(pert_bml[k], resp_bml[k]);
+    bml_scale_inplace(&scale, resp_bml[k]);
+  }
+  stopTimer(normTimer);
+
+  bml_matrix_t* x2_bml = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+  bml_matrix_t* t_bml = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+  bml_matrix_t* tt_bml = bml_zero_matrix(matrix_type, precision, N, M, dmode);
+
+  for (int i = 0; i < seq->nsteps; i++)
+  {
+    // Responses use X0 before the update
+    for (int k = 0; k < nresp; k++)
+    {
+      // X0*X1 + X1*X0 = T + T^T with T = X0*X1
+      startTimer(mmTimer);
+      bml_multiply(x_bml, resp_bml[k], t_bml, ONE, ZERO, threshold);
+      stopTimer(mmTimer);
+      nmult++;
+
+      startTimer(xaddTimer);
+      bml_copy(t_bml, tt_bml);
+      bml_transpose(tt_bml);
+      bml_add(t_bml, tt_bml, ONE, ONE, threshold);
+      if (seq->branch[i] == 1)
+        bml_add(resp_bml[k], t_bml, TWO, MINUS_ONE, threshold);
+      else
+        bml_copy(t_bml, resp_bml[k]);
+      stopTimer(xaddTimer);
+    }
+
+    startTimer(x2Timer);
+    bml_multiply(x_bml, x_bml, x2_bml, ONE, ZERO, threshold);
+    stopTimer(x2Timer);
+    nmult++;
+
+    if (seq->branch[i] == 1)
+    {
+      // X0 = 2 * X0 - X0^2
+      startTimer(xaddTimer);
+      bml_add(x_bml, x2_bml, TWO, MINUS_ONE, threshold);
+      stopTimer(xaddTimer);
+    }
+    else
+    {
+      // X0 = X0^2, swap buffers
+      bml_matrix_t* tmp_bml = x_bml;
+      x_bml = x2_bml;
+      x2_bml = tmp_bml;
+    }
+  }
+
+  // Multiply by 2
+  for (int k = 0; k < nresp; k++)
+    bml_scale_inplace(&TWO, resp_bml[k]);
+
+  stopTimer(responseTimer);
+
+  bml_deallocate(&x_bml);
+  bml_deallocate(&x2_bml);
+  bml_deallocate(&t_bml);
+  bml_deallocate(&tt_bml);
+
+  if (report == 0) return;
+
+  real_t* trP1 = malloc(nresp * sizeof(real_t));
+  real_t* trP1H1 = malloc(nresp * nresp * sizeof(real_t));
+  for (int k = 0; k < nresp; k++)
+  {
+    trP1[k] = bml_trace(resp_bml[k]);
+    for (int l = 0; l < nresp; l++)
+      trP1H1[k*nresp+l] = bml_trace_mult(resp_bml[k], pert_bml[l]);
+  }
+
+  if (bml_printRank())
+  {
+    printf("\nResponse:\n");
+    printf("%d perturbations, %d steps, %d multiplies (%d shared X0^2)\n",
+      nresp, seq->nsteps, nmult, seq->nsteps);
+    for (int k = 0; k < nresp; k++)
+    {
+      printf("Tr(P1_%d) = %e  Tr(P1_%d*H1_l) =", k, trP1[k], k);
+      for (int l = 0; l < nresp; l++)
+        printf(" %e", trP1H1[k*nresp+l]);
+      printf("\n");
+    }
+  }
+
+  free(trP1);
+  free(trP1H1);
+}
+
+/// \details
+/// Deallocate an array of n matrices.
+void destroyMatrices(bml_matrix_t*** a_bml,
+                     const int n)
+{
+  for (int k = 0; k < n; k++)
+    bml_deallocate(&(*a_bml)[k]);
+  free(*a_bml);
+  *a_bml = NULL;
+}
+
+#endif
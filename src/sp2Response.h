@@ -0,0 +1,29 @@
+/// \file
+/// SP2 density matrix response functions.
+
+#ifndef __SP2RESPONSE_H
+#define __SP2RESPONSE_H
+
+#include "bml.h"
+
+#include <stdio.h>
+
+#include "mytype.h"
+#include "sp2Basic.h"
+
+bml_matrix_t** responsePerturbations(const bml_matrix_t* h_bml,
+                                     const int nresp,
+                                     const char* pertName);
+
+void responseLoop(const bml_matrix_t* h_bml,
+                  bml_matrix_t** pert_bml,
+                  bml_matrix_t** resp_bml,
+                  const int nresp,
+                  const Sp2Sequence* seq,
+                  const int report,
+                  const real_t threshold);
+
+void destroyMatrices(bml_matrix_t*** a_bml,
+                     const int n);
+
+#endif
@@ -16,4 +16,30 @@
 #include "sp2Imp.h"
 #endif
 
+#ifdef SP2_CHEBYSHEV
+#include "sp2Chebyshev.h"
+#endif
+
+#ifdef SP2_RESPONSE
+#include "sp2Response.h"
+#endif
+
+#ifdef SP2_KERNEL
+#include "sp2Kernel.h"
+#endif
+
+#if defined(SP2_BASIC) && defined(DECOMP_GRAPH)
+#include "sp2Graph.h"
+#endif
+
+// GRAPH replaces the BASIC solve. RESPONSE and KERNEL follow the
+// branch sequence recorded by sp2Loop, so they keep the plain solve.
+#if defined(SP2_BASIC) && defined(DECOMP_GRAPH) && !defined(SP2_RESPONSE)
+#define SP2_GRAPH
+#endif
+
+#ifdef SP2_SUBMATRIX
+#include "sp2Submatrix.h"
+#endif
+
 #endif
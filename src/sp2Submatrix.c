@@ -0,0 +1,364 @@
+/// \file
+/// Submatrix solver.
+///
+/// Each block of blockSize core rows is grown into a neighborhood in the
+/// graph of H (hops steps along its non-zeroes), which defines a dense
+/// principal submatrix H_s. Every H_s is solved on its own, and the rows
+/// of P_s that belong to the core are the core rows of P. Blocks only
+/// share the chemical potential, so the work is small dense BLAS-3 on
+/// independent matrices spread over OpenMP threads, in place of the
+/// global sparse products of the SP2 loop.
+///
+/// With method 0 each H_s is diagonalized and mu is exact for the
+/// assembled P: eigenvector k of a block carries w_k = sum over the core
+/// rows of V_ik^2 states, the weights of all blocks add up to N, and
+/// states are filled in order of energy until they hold nocc.
+///
+/// With method 1 each H_s is purified at the given mu, as in IMP. SP2
+/// cannot be used here, since choosing its branches needs the
+/// occupation of H_s, which is not known; the McWeeny step 3X^2 - 2X^3
+/// keeps mu fixed at X = 1/2 instead. Any mu inside the gap gives the
+/// same P, and Tr(P) is reported against 2*nocc as a check.
+
+#ifdef SP2_SUBMATRIX
+
+#include "bml.h"
+
+#include "sp2Submatrix.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "performance.h"
+#include "parallel.h"
+#include "constants.h"
+#include "csrMatrix.h"
+
+/// Relative distance below which eigenvalues count as degenerate
+#define SUB_TIE_TOL 1.0E-10
+
+/// A core block and its submatrix.
+typedef struct SubBlockSt
+{
+  int core;       //!< first core row
+  int ncore;      //!< number of core rows
+  int n;          //!< submatrix size
+  int* index;     //!< row of H for each row of H_s, core rows first
+  real_t* a;      //!< H_s, then its eigenvectors or the core rows of P_s
+  real_t* eval;   //!< eigenvalues of H_s (method 0)
+  real_t* weight; //!< core weight of each eigenvector (method 0)
+  int iter;       //!< purification steps (method 1)
+} SubBlock;
+
+/// An eigenvalue of some block with its core weight.
+typedef struct SubStateSt
+{
+  real_t e;
+  real_t w;
+} SubState;
+
+/// \details
+/// Ascending energy for qsort.
+static int compareState(const void* a,
+                        const void* b)
+{
+  real_t x = ((const SubState*) a)->e;
+  real_t y = ((const SubState*) b)->e;
+
+  return (x > y) - (x < y);
+}
+
+/// \details
+/// Find the neighborhood of a block and extract the dense H_s. local
+/// and list are scratch as in csrNeighborhood.
+static void extractBlock(const CsrMatrix* h,
+                         SubBlock* blk,
+                         const int hops,
+                         int* local,
+                         int* list)
+{
+  for (int i = 0; i < blk->ncore; i++)
+    list[i] = blk->core + i;
+
+  int n = csrNeighborhood(h, list, blk->ncore, hops, local, list);
+
+  blk->n = n;
+  blk->index = malloc(n * sizeof(int));
+  for (int p = 0; p < n; p++)
+    blk->index[p] = list[p];
+  blk->a = malloc((size_t) n * n * sizeof(real_t));
+  csrSubmatrix(h, blk->index, n, local, blk->a);
+}
+
+/// \details
+/// Diagonalize H_s, keeping the eigenvectors in blk->a (row major,
+/// eigenvector k in column k) and the core weight of each.
+static void diagonalizeBlock(SubBlock* blk,
+                             const bml_matrix_precision_t precision)
+{
+  int n = blk->n;
+
+  bml_matrix_t* a_bml = bml_import_from_dense(dense, precision,
+    dense_row_major, n, n, blk->a, ZERO, sequential);
+  bml_matrix_t* v_bml = bml_zero_matrix(dense, precision, n, n, sequential);
+  blk->eval = malloc(n * sizeof(real_t));
+  bml_diagonalize(a_bml, blk->eval, v_bml);
+
+  real_t* v = bml_export_to_dense(v_bml, dense_row_major);
+  for (int i = 0; i < n * n; i++)
+    blk->a[i] = v[i];
+  bml_free_memory(v);
+
+  blk->weight = calloc(n, sizeof(real_t));
+  for (int i = 0; i < blk->ncore; i++)
+    for (int k = 0; k < n; k++)
+      blk->weight[k] += blk->a[i*n+k] * blk->a[i*n+k];
+
+  bml_deallocate(&a_bml);
+  bml_deallocate(&v_bml);
+}
+
+/// \details
+/// Replace the eigenvectors in blk->a by the core rows of
+/// P_s = V*diag(2*occ)*V^T. States below eLow are filled, those from
+/// eLow to eHigh (the degenerate group at the Fermi level) hold the
+/// fraction frac.
+static void occupyBlock(SubBlock* blk,
+                        const real_t eLow,
+                        const real_t eHigh,
+                        const real_t frac)
+{
+  int n = blk->n;
+  real_t* occ = malloc(n * sizeof(real_t));
+  for (int k = 0; k < n; k++)
+  {
+    if (blk->eval[k] < eLow) occ[k] = TWO;
+    else if (blk->eval[k] <= eHigh) occ[k] = TWO * frac;
+    else occ[k] = ZERO;
+  }
+
+  real_t* p = calloc(blk->ncore * n, sizeof(real_t));
+  for (int i = 0; i < blk->ncore; i++)
+    for (int k = 0; k < n; k++)
+    {
+      if (occ[k] == ZERO) continue;
+      real_t vik = occ[k] * blk->a[i*n+k];
+      for (int j = 0; j < n; j++)
+        p[i*n+j] += vik * blk->a[j*n+k];
+    }
+
+  free(blk->a);
+  blk->a = p;
+  free(occ);
+}
+
+/// \details
+/// McWeeny purification of H_s at chemical potential mu. X0 maps the
+/// Gershgorin interval of H_s into [0,1] with mu at 1/2. Stops when
+/// Tr(X - X^2) drops below idemTol or stops decreasing. The core rows
+/// of P_s = 2X replace H_s in blk->a.
+static void purifyBlock(SubBlock* blk,
+                        const real_t mu,
+                        const bml_matrix_precision_t precision,
+                        const int maxiter,
+                        const real_t idemTol)
+{
+  int n = blk->n;
+
+  bml_matrix_t* x_bml = bml_import_from_dense(dense, precision,
+    dense_row_major, n, n, blk->a, ZERO, sequential);
+  bml_matrix_t* x2_bml = bml_zero_matrix(dense, precision, n, n, sequential);
+  bml_matrix_t* t_bml = bml_zero_matrix(dense, precision, n, n, sequential);
+
+  real_t* bnd = bml_gershgorin(x_bml);
+  real_t lambda = HALF / MAX(MAX(bnd[1] - mu, mu - bnd[0]), 1.0E-12);
+  bml_free_memory(bnd);
+  bml_scale_add_identity(x_bml, -lambda, HALF + lambda * mu, ZERO);
+
+  real_t idemPrev = (real_t) n;
+  blk->iter = 0;
+  while (blk->iter < maxiter)
+  {
+    bml_multiply(x_bml, x_bml, x2_bml, ONE, ZERO, ZERO);
+    real_t idem = ABS(bml_trace(x_bml) - bml_trace(x2_bml));
+    if (idem <= idemTol || (blk->iter > 2 && idem >= idemPrev)) break;
+    idemPrev = idem;
+
+    // X = 3X^2 - 2X^3
+    bml_multiply(x2_bml, x_bml, t_bml, ONE, ZERO, ZERO);
+    bml_add(t_bml, x2_bml, -TWO, 3.0, ZERO);
+    bml_matrix_t* swap = x_bml;
+    x_bml = t_bml;
+    t_bml = swap;
+    blk->iter++;
+  }
+
+  real_t* x = bml_export_to_dense(x_bml, dense_row_major);
+  real_t* p = malloc(blk->ncore * n * sizeof(real_t));
+  for (int i = 0; i < blk->ncore * n; i++)
+    p[i] = TWO * x[i];
+  bml_free_memory(x);
+  free(blk->a);
+  blk->a = p;
+
+  bml_deallocate(&x_bml);
+  bml_deallocate(&x2_bml);
+  bml_deallocate(&t_bml);
+}
+
+/// \details
+/// Density matrix from independent submatrix solves, method 0 by
+/// diagonalization, which sets *mu to the Fermi level, and 1 by
+/// purification at *mu. The assembled P is
+/// symmetrized, since row i comes from the block of i and column i
+/// from the blocks of the other rows.
+void submatrixLoop(const bml_matrix_t* h_bml,
+                   bml_matrix_t* rho_bml,
+                   const real_t nocc,
+                   real_t* mu,
+                   const int blockSize,
+                   const int hops,
+                   const int method,
+                   const int maxiter,
+                   const real_t idemTol,
+                   const real_t threshold)
+{
+  int N = bml_get_N(h_bml);
+  bml_matrix_precision_t precision = bml_get_precision(h_bml);
+  int bsize = MAX(MIN(blockSize, N), 1);
+  int nblocks = (N + bsize - 1) / bsize;
+
+  // Neighborhoods and submatrices
+  startTimer(assembleTimer);
+  CsrMatrix* h = csrFromBml(h_bml, threshold);
+  SubBlock* blk = calloc(nblocks, sizeof(SubBlock));
+  for (int b = 0; b < nblocks; b++)
+  {
+    blk[b].core = b * bsize;
+    blk[b].ncore = MIN(bsize, N - blk[b].core);
+  }
+
+  #pragma omp parallel
+  {
+    int* local = malloc(N * sizeof(int));
+    int* list = malloc(N * sizeof(int));
+    for (int i = 0; i < N; i++)
+      local[i] = -1;
+
+    #pragma omp for schedule(dynamic)
+    for (int b = 0; b < nblocks; b++)
+      extractBlock(h, &blk[b], hops, local, list);
+
+    free(local);
+    free(list);
+  }
+  csrDestroy(&h);
+  stopTimer(assembleTimer);
+
+  // Independent solves
+  startTimer(subsolveTimer);
+  #pragma omp parallel for schedule(dynamic)
+  for (int b = 0; b < nblocks; b++)
+  {
+    if (method == 1)
+      purifyBlock(&blk[b], *mu, precision, maxiter, idemTol);
+    else
+      diagonalizeBlock(&blk[b], precision);
+  }
+
+  real_t frac = ONE;
+  if (method != 1)
+  {
+    // Fill states of all blocks in order of energy up to nocc
+    int nstates = 0;
+    for (int b = 0; b < nblocks; b++)
+      nstates += blk[b].n;
+    SubState* state = malloc(nstates * sizeof(SubState));
+    int s = 0;
+    for (int b = 0; b < nblocks; b++)
+      for (int k = 0; k < blk[b].n; k++)
+      {
+        state[s].e = blk[b].eval[k];
+        state[s++].w = blk[b].weight[k];
+      }
+    qsort(state, nstates, sizeof(SubState), compareState);
+
+    // States of different blocks rarely agree to the last bit, so
+    // degeneracy is judged relative to the spectral width
+    real_t tol = SUB_TIE_TOL * (state[nstates-1].e - state[0].e);
+    real_t eHigh = state[nstates-1].e;
+    real_t filled = ZERO;
+    s = 0;
+    while (s < nstates)
+    {
+      // Degenerate states are filled together
+      int t = s;
+      real_t w = ZERO;
+      while (t < nstates && state[t].e <= state[s].e + tol)
+        w += state[t++].w;
+      *mu = state[s].e;
+      eHigh = state[t-1].e;
+      if (filled + w >= nocc)
+      {
+        frac = (w > ZERO) ? (nocc - filled) / w : ONE;
+        break;
+      }
+      filled += w;
+      s = t;
+    }
+    free(state);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < nblocks; b++)
+      occupyBlock(&blk[b], *mu, eHigh, frac);
+  }
+  stopTimer(subsolveTimer);
+
+  // Core rows into P
+  startTimer(assembleTimer);
+  real_t* row = calloc(N, sizeof(real_t));
+  int nmax = 0;
+  int itmax = 0;
+  real_t nsum = ZERO;
+  for (int b = 0; b < nblocks; b++)
+  {
+    int n = blk[b].n;
+    for (int i = 0; i < blk[b].ncore; i++)
+    {
+      for (int q = 0; q < n; q++)
+        row[blk[b].index[q]] = blk[b].a[i*n+q];
+      bml_set_row(rho_bml, blk[b].core + i, row, threshold);
+      for (int q = 0; q < n; q++)
+        row[blk[b].index[q]] = ZERO;
+    }
+    nmax = MAX(nmax, n);
+    itmax = MAX(itmax, blk[b].iter);
+    nsum += n;
+
+    free(blk[b].index);
+    free(blk[b].a);
+    free(blk[b].eval);
+    free(blk[b].weight);
+  }
+  free(row);
+  free(blk);
+
+  bml_matrix_t* t_bml = bml_transpose_new(rho_bml);
+  bml_add(rho_bml, t_bml, HALF, HALF, threshold);
+  bml_deallocate(&t_bml);
+  stopTimer(assembleTimer);
+
+  if (bml_printRank())
+  {
+    printf("Submatrix: %d blocks of %d rows, size avg %lg max %d\n",
+      nblocks, bsize, nsum / nblocks, nmax);
+    if (method == 1)
+      printf("Submatrix purification: mu = %lg, max steps = %d\n", *mu, itmax);
+    else
+      printf("Submatrix diagonalization: Fermi level = %lg\n", *mu);
+    printf("Tr(P) = %lg  2*nocc = %lg\n", bml_trace(rho_bml), TWO * nocc);
+  }
+}
+
+#endif
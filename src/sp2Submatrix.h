@@ -0,0 +1,24 @@
+/// \file
+/// Submatrix solver functions.
+
+#ifndef __SP2SUBMATRIX_H
+#define __SP2SUBMATRIX_H
+
+#include "bml.h"
+
+#include <stdio.h>
+
+#include "mytype.h"
+
+void submatrixLoop(const bml_matrix_t* h_bml,
+                   bml_matrix_t* rho_bml,
+                   const real_t nocc,
+                   real_t* mu,
+                   const int blockSize,
+                   const int hops,
+                   const int method,
+                   const int maxiter,
+                   const real_t idemTol,
+                   const real_t threshold);
+
+#endif
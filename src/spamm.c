@@ -0,0 +1,325 @@
+/// \file
+/// Sparse approximate matrix multiply (SpAMM).
+///
+/// The matrix is tiled into dense leaf blocks, and a quadtree holds the
+/// Frobenius norm of every block at every level, a parent being the
+/// root sum of squares of its four children. In C = A*B the
+/// contribution of A(i,k)*B(k,j) at any level is bounded by
+/// ||A(i,k)|| * ||B(k,j)||; when that falls below tol the whole subtree
+/// of block products is skipped without being formed. For matrices
+/// with decay away from the diagonal, as X in SP2, most far off
+/// diagonal products are screened at high levels of the tree. The
+/// error in C is bounded by tol times the number of screened products
+/// in each block.
+
+#include "bml.h"
+
+#include "spamm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "constants.h"
+
+/// \details
+/// Rows (or columns) of leaf block index I that lie inside the matrix.
+static int leafRows(const SpammMatrix* a,
+                    const int I)
+{
+  return MAX(MIN(a->leaf, a->N - I * a->leaf), 0);
+}
+
+/// \details
+/// Recompute the norms of all levels from the leaf blocks.
+static void spammNorms(SpammMatrix* a)
+{
+  int nb = a->nb;
+  int lsize = a->leaf * a->leaf;
+
+  #pragma omp parallel for
+  for (int b = 0; b < nb * nb; b++)
+  {
+    real_t sum = ZERO;
+    if (a->block[b] != NULL)
+      for (int i = 0; i < lsize; i++)
+        sum += a->block[b][i] * a->block[b][i];
+    a->norm[0][b] = sqrt(sum);
+  }
+
+  for (int l = 1; l < a->nlevels; l++)
+  {
+    int n = nb >> l;
+    real_t* child = a->norm[l-1];
+    for (int i = 0; i < n; i++)
+      for (int j = 0; j < n; j++)
+      {
+        real_t c00 = child[(2*i) * 2 * n + 2*j];
+        real_t c01 = child[(2*i) * 2 * n + 2*j + 1];
+        real_t c10 = child[(2*i+1) * 2 * n + 2*j];
+        real_t c11 = child[(2*i+1) * 2 * n + 2*j + 1];
+        a->norm[l][i*n+j] = sqrt(c00*c00 + c01*c01 + c10*c10 + c11*c11);
+      }
+  }
+}
+
+/// \details
+/// Zero N x N matrix with leaf x leaf blocks.
+SpammMatrix* spammZero(const int N,
+                       const int leaf)
+{
+  SpammMatrix* a = malloc(sizeof(SpammMatrix));
+  a->N = N;
+  a->leaf = leaf;
+
+  int nleaf = (N + leaf - 1) / leaf;
+  a->nb = 1;
+  a->nlevels = 1;
+  while (a->nb < nleaf)
+  {
+    a->nb *= 2;
+    a->nlevels++;
+  }
+
+  a->block = calloc(a->nb * a->nb, sizeof(real_t*));
+  a->norm = malloc(a->nlevels * sizeof(real_t*));
+  for (int l = 0; l < a->nlevels; l++)
+  {
+    int n = a->nb >> l;
+    a->norm[l] = calloc(n * n, sizeof(real_t));
+  }
+
+  return a;
+}
+
+/// \details
+/// Block copy of a BML matrix. Entries at or below threshold are
+/// dropped, and blocks without any other entry are not stored.
+SpammMatrix* spammFromBml(const bml_matrix_t* a_bml,
+                          const int leaf,
+                          const real_t threshold)
+{
+  int N = bml_get_N(a_bml);
+  SpammMatrix* a = spammZero(N, leaf);
+  int nb = a->nb;
+
+  for (int i = 0; i < N; i++)
+  {
+    real_t* row = bml_get_row((bml_matrix_t*) a_bml, i);
+    int I = i / leaf;
+    int ii = i % leaf;
+
+    for (int j = 0; j < N; j++)
+    {
+      if (ABS(row[j]) <= threshold) continue;
+
+      real_t** blk = &a->block[I * nb + j / leaf];
+      if (*blk == NULL)
+        *blk = calloc(leaf * leaf, sizeof(real_t));
+      (*blk)[ii * leaf + j % leaf] = row[j];
+    }
+    bml_free_memory(row);
+  }
+
+  spammNorms(a);
+
+  return a;
+}
+
+/// \details
+/// Copy a block matrix into a BML matrix of the same size, row by row.
+void spammToBml(const SpammMatrix* a,
+                bml_matrix_t* a_bml,
+                const real_t threshold)
+{
+  int leaf = a->leaf;
+  int nb = a->nb;
+  real_t* row = calloc(nb * leaf, sizeof(real_t));
+
+  for (int i = 0; i < a->N; i++)
+  {
+    int I = i / leaf;
+    int ii = i % leaf;
+    for (int J = 0; J < nb; J++)
+    {
+      real_t* blk = a->block[I * nb + J];
+      for (int jj = 0; jj < leaf; jj++)
+        row[J * leaf + jj] = (blk != NULL) ? blk[ii * leaf + jj] : ZERO;
+    }
+    bml_set_row(a_bml, i, row, threshold);
+  }
+
+  free(row);
+}
+
+/// \details
+/// Accumulate the products A(I,k)*B(k,J) into the leaf block c, for
+/// the leaf columns k of A under block K of level l. Subtrees with a
+/// zero norm are empty. Once the norm bound of a subtree is below tol
+/// it is not descended, and the leaf products under it with both
+/// blocks non-empty, the ones that would have been formed, are counted
+/// as skipped.
+static void accumulate(const SpammMatrix* a,
+                       const SpammMatrix* b,
+                       const int I,
+                       const int J,
+                       const int l,
+                       const int K,
+                       const real_t tol,
+                       real_t* c,
+                       long* products,
+                       long* skipped)
+{
+  int n = a->nb >> l;
+  real_t normA = a->norm[l][(I >> l) * n + K];
+  real_t normB = b->norm[l][K * n + (J >> l)];
+  if (normA == ZERO || normB == ZERO) return;
+
+  if (normA * normB < tol)
+  {
+    int nb = a->nb;
+    for (int k = K << l; k < (K + 1) << l; k++)
+      if (a->norm[0][I * nb + k] != ZERO && b->norm[0][k * nb + J] != ZERO)
+        (*skipped)++;
+    return;
+  }
+
+  if (l > 0)
+  {
+    accumulate(a, b, I, J, l - 1, 2 * K, tol, c, products, skipped);
+    accumulate(a, b, I, J, l - 1, 2 * K + 1, tol, c, products, skipped);
+    return;
+  }
+
+  int leaf = a->leaf;
+  const real_t* ablk = a->block[I * a->nb + K];
+  const real_t* bblk = b->block[K * b->nb + J];
+  for (int i = 0; i < leaf; i++)
+    for (int k = 0; k < leaf; k++)
+    {
+      real_t aik = ablk[i * leaf + k];
+      if (aik == ZERO) continue;
+      for (int j = 0; j < leaf; j++)
+        c[i * leaf + j] += aik * bblk[k * leaf + j];
+    }
+  (*products)++;
+}
+
+/// \details
+/// C = A*B, skipping block products with ||A(i,k)|| * ||B(k,j)|| < tol
+/// at any level. Entries of C at or below threshold are dropped, as in
+/// bml_multiply, and so are leaf blocks left empty. The leaf products
+/// formed and skipped are added to products and skipped.
+void spammMultiply(const SpammMatrix* a,
+                   const SpammMatrix* b,
+                   SpammMatrix* c,
+                   const real_t tol,
+                   const real_t threshold,
+                   long* products,
+                   long* skipped)
+{
+  int nb = a->nb;
+  int lsize = a->leaf * a->leaf;
+  int top = a->nlevels - 1;
+  long nprod = 0;
+  long nskip = 0;
+
+  #pragma omp parallel reduction(+:nprod,nskip)
+  {
+    real_t* work = malloc(lsize * sizeof(real_t));
+
+    #pragma omp for schedule(dynamic)
+    for (int ij = 0; ij < nb * nb; ij++)
+    {
+      int I = ij / nb;
+      int J = ij % nb;
+      free(c->block[ij]);
+      c->block[ij] = NULL;
+      if (leafRows(a, I) == 0 || leafRows(a, J) == 0) continue;
+
+      for (int i = 0; i < lsize; i++)
+        work[i] = ZERO;
+      long before = nprod;
+      accumulate(a, b, I, J, top, 0, tol, work, &nprod, &nskip);
+      if (nprod == before) continue;
+
+      int nonzero = 0;
+      for (int i = 0; i < lsize; i++)
+      {
+        if (ABS(work[i]) <= threshold) work[i] = ZERO;
+        else nonzero = 1;
+      }
+      if (nonzero == 0) continue;
+
+      c->block[ij] = work;
+      work = malloc(lsize * sizeof(real_t));
+    }
+
+    free(work);
+  }
+
+  spammNorms(c);
+
+  *products += nprod;
+  *skipped += nskip;
+}
+
+/// \details
+/// A = alpha*A + beta*B, dropping entries at or below threshold.
+void spammAdd(SpammMatrix* a,
+              const SpammMatrix* b,
+              const real_t alpha,
+              const real_t beta,
+              const real_t threshold)
+{
+  int lsize = a->leaf * a->leaf;
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int k = 0; k < a->nb * a->nb; k++)
+  {
+    if (a->block[k] == NULL && b->block[k] == NULL) continue;
+    if (a->block[k] == NULL)
+      a->block[k] = calloc(lsize, sizeof(real_t));
+
+    real_t* ablk = a->block[k];
+    const real_t* bblk = b->block[k];
+    for (int i = 0; i < lsize; i++)
+    {
+      ablk[i] = alpha * ablk[i] + ((bblk != NULL) ? beta * bblk[i] : ZERO);
+      if (ABS(ablk[i]) <= threshold) ablk[i] = ZERO;
+    }
+  }
+
+  spammNorms(a);
+}
+
+/// \details
+/// Trace of a block matrix.
+real_t spammTrace(const SpammMatrix* a)
+{
+  real_t trace = ZERO;
+
+  for (int I = 0; I < a->nb; I++)
+  {
+    const real_t* blk = a->block[I * a->nb + I];
+    if (blk == NULL) continue;
+    for (int i = 0; i < leafRows(a, I); i++)
+      trace += blk[i * a->leaf + i];
+  }
+
+  return trace;
+}
+
+/// \details
+/// Deallocate a block matrix.
+void spammDestroy(SpammMatrix** a)
+{
+  for (int k = 0; k < (*a)->nb * (*a)->nb; k++)
+    free((*a)->block[k]);
+  for (int l = 0; l < (*a)->nlevels; l++)
+    free((*a)->norm[l]);
+  free((*a)->block);
+  free((*a)->norm);
+  free(*a);
+  *a = NULL;
+}
@@ -0,0 +1,55 @@
+/// \file
+/// Block matrices with a quadtree of norms for SpAMM products.
+
+#ifndef __SPAMM_H
+#define __SPAMM_H
+
+#include "bml.h"
+
+#include "mytype.h"
+
+/// Rows and columns per leaf block
+#define SPAMM_LEAF 32
+
+/// Square matrix stored as dense leaf blocks, with the Frobenius norms
+/// of the blocks at every level of a quadtree over them.
+typedef struct SpammMatrixSt
+{
+  int N;               //!< number of rows (and columns)
+  int leaf;            //!< rows and columns of a leaf block
+  int nb;              //!< leaf blocks per row, padded to a power of two
+  int nlevels;         //!< quadtree levels, 0 is the leaves
+  real_t** block;      //!< nb*nb leaf blocks (row major), NULL if zero
+  real_t** norm;       //!< norm[l] holds the (nb>>l)^2 norms of level l
+} SpammMatrix;
+
+SpammMatrix* spammZero(const int N,
+                       const int leaf);
+
+SpammMatrix* spammFromBml(const bml_matrix_t* a_bml,
+                          const int leaf,
+                          const real_t threshold);
+
+void spammToBml(const SpammMatrix* a,
+                bml_matrix_t* a_bml,
+                const real_t threshold);
+
+void spammMultiply(const SpammMatrix* a,
+                   const SpammMatrix* b,
+                   SpammMatrix* c,
+                   const real_t tol,
+                   const real_t threshold,
+                   long* products,
+                   long* skipped);
+
+void spammAdd(SpammMatrix* a,
+              const SpammMatrix* b,
+              const real_t alpha,
+              const real_t beta,
+              const real_t threshold);
+
+real_t spammTrace(const SpammMatrix* a);
+
+void spammDestroy(SpammMatrix** a);
+
+#endif
@@ -0,0 +1,275 @@
+/// \file
+/// Interior eigenvalues from SP2 intermediates.
+///
+/// Following Rubensson and Niklasson (2014), an SP2 iterate X = p(H)
+/// is a polynomial in H with the eigenvectors of H, and the iteration
+/// drives each eigenvalue x = p(e) towards 0 or 1, those next to the
+/// Fermi level last. So X^2 (I - X), with eigenvalues x^2 (1 - x), is
+/// largest on the occupied states nearest the gap, and X (I - X)^2 on
+/// the unoccupied ones. A short Lanczos run on each (three sparse
+/// products with X per step) finds the states around the gap without
+/// touching the rest of the spectrum. Their energies follow by
+/// Rayleigh-Ritz with H on the joint Lanczos subspace, and each state
+/// is occupied if its expectation value in X is above 1/2.
+
+#include "bml.h"
+
+#include "spectrumSlice.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "parallel.h"
+#include "constants.h"
+#include "lanczos.h"
+#include "stochasticTrace.h"
+
+/// \details
+/// y = X^2 (I - X) v for side > 0, X (I - X)^2 v otherwise. t is
+/// scratch for three vectors.
+static void sliceMatVec(const CsrMatrix* x,
+                        const int side,
+                        const real_t* v,
+                        real_t* t,
+                        real_t* y)
+{
+  int N = x->N;
+  real_t* t1 = t;
+  real_t* t2 = t + N;
+  real_t* t3 = t + 2 * N;
+
+  csrMatVec(x, v, t1);
+  csrMatVec(x, t1, t2);
+  csrMatVec(x, t2, t3);
+  if (side > 0)
+    for (int i = 0; i < N; i++)
+      y[i] = t2[i] - t3[i];
+  else
+    for (int i = 0; i < N; i++)
+      y[i] = t1[i] - TWO * t2[i] + t3[i];
+}
+
+/// \details
+/// Append to the n vectors in v (each of length N, orthonormal) up to
+/// m Ritz vectors for the largest eigenvalues of the slice operator
+/// of the given side, orthonormalized against v. Returns the new
+/// number of vectors and adds the Lanczos steps taken to steps.
+static int sliceLanczos(const CsrMatrix* x,
+                        const int side,
+                        const int m,
+                        real_t* v,
+                        int n,
+                        int* steps)
+{
+  int N = x->N;
+  int k = MIN(4 * m + 20, N);
+
+  real_t* q = malloc((size_t) (k + 1) * N * sizeof(real_t));
+  real_t* w = malloc(N * sizeof(real_t));
+  real_t* t = malloc(3 * N * sizeof(real_t));
+  real_t* alpha = malloc(k * sizeof(real_t));
+  real_t* beta = malloc(k * sizeof(real_t));
+
+  randomProbe(N, side > 0 ? 0 : 1, q);
+  real_t qnorm = sqrt((real_t) N);
+  for (int i = 0; i < N; i++) q[i] /= qnorm;
+
+  // Fully reorthogonalized, since k is small
+  int nt = 0;
+  for (int j = 0; j < k; j++)
+  {
+    real_t* qj = q + (size_t) j * N;
+    sliceMatVec(x, side, qj, t, w);
+
+    alpha[j] = csrDot(N, qj, w);
+    for (int pass = 0; pass < 2; pass++)
+      for (int i = 0; i <= j; i++)
+      {
+        real_t* qi = q + (size_t) i * N;
+        real_t c = csrDot(N, qi, w);
+        for (int l = 0; l < N; l++) w[l] -= c * qi[l];
+      }
+    beta[j] = sqrt(csrDot(N, w, w));
+    nt++;
+
+    if (beta[j] <= 1.0E-12) break;
+    real_t* qn = q + (size_t) (j + 1) * N;
+    for (int l = 0; l < N; l++) qn[l] = w[l] / beta[j];
+  }
+  *steps += nt;
+
+  real_t* z = malloc(nt * nt * sizeof(real_t));
+  tridiagonalEigen(nt, alpha, beta, z);
+
+  int* used = calloc(nt, sizeof(int));
+  for (int c = 0; c < MIN(m, nt); c++)
+  {
+    int best = -1;
+    for (int j = 0; j < nt; j++)
+      if (!used[j] && (best < 0 || alpha[j] > alpha[best])) best = j;
+    used[best] = 1;
+
+    real_t* vn = v + (size_t) n * N;
+    for (int l = 0; l < N; l++) vn[l] = ZERO;
+    for (int j = 0; j < nt; j++)
+    {
+      real_t zj = z[j * nt + best];
+      real_t* qj = q + (size_t) j * N;
+      for (int l = 0; l < N; l++) vn[l] += zj * qj[l];
+    }
+
+    // Drop vectors already (nearly) in span(v) from the other side
+    for (int pass = 0; pass < 2; pass++)
+      for (int i = 0; i < n; i++)
+      {
+        real_t* vi = v + (size_t) i * N;
+        real_t c = csrDot(N, vi, vn);
+        for (int l = 0; l < N; l++) vn[l] -= c * vi[l];
+      }
+    real_t vnorm = sqrt(csrDot(N, vn, vn));
+    if (vnorm < 1.0E-6) continue;
+    for (int l = 0; l < N; l++) vn[l] /= vnorm;
+    n++;
+  }
+
+  free(used);
+  free(z);
+  free(q);
+  free(w);
+  free(t);
+  free(alpha);
+  free(beta);
+
+  return n;
+}
+
+/// \details
+/// Eigenvalues of H for about nslice states nearest the Fermi level,
+/// from the SP2 iterate x (taken at SP2 iteration iter). Half of them
+/// come from the occupied side, half from the unoccupied side. Prints
+/// each with its occupation and residual ||Hu - eu||, then HOMO, LUMO
+/// and gap when both are among them.
+void spectrumSlice(const bml_matrix_t* h_bml,
+                   const CsrMatrix* x,
+                   const int nslice,
+                   const int iter)
+{
+  int N = x->N;
+  int mslice = MAX(MIN(nslice, N), 1);
+
+  CsrMatrix* h = csrFromBml(h_bml, ZERO);
+
+  real_t* v = malloc((size_t) mslice * N * sizeof(real_t));
+  int nt = 0;
+  int m = sliceLanczos(x, 1, (mslice + 1) / 2, v, 0, &nt);
+  m = sliceLanczos(x, -1, mslice / 2, v, m, &nt);
+
+  real_t* hv = malloc((size_t) m * N * sizeof(real_t));
+  real_t* xv = malloc((size_t) m * N * sizeof(real_t));
+  for (int c = 0; c < m; c++)
+  {
+    csrMatVec(h, v + (size_t) c * N, hv + (size_t) c * N);
+    csrMatVec(x, v + (size_t) c * N, xv + (size_t) c * N);
+  }
+
+  // Rayleigh-Ritz with H on span(v), occupations from X
+  real_t* g = malloc(m * m * sizeof(real_t));
+  real_t* o = malloc(m * m * sizeof(real_t));
+  for (int a = 0; a < m; a++)
+    for (int b = 0; b < m; b++)
+    {
+      g[a*m+b] = csrDot(N, v + (size_t) a * N, hv + (size_t) b * N);
+      o[a*m+b] = csrDot(N, v + (size_t) a * N, xv + (size_t) b * N);
+    }
+  for (int a = 0; a < m; a++)
+    for (int b = 0; b < a; b++)
+      g[a*m+b] = g[b*m+a] = HALF * (g[a*m+b] + g[b*m+a]);
+
+  bml_matrix_precision_t precision = bml_get_precision(h_bml);
+  bml_matrix_t* g_bml = bml_import_from_dense(dense, precision,
+    dense_row_major, m, m, g, ZERO, sequential);
+  bml_matrix_t* s_bml = bml_zero_matrix(dense, precision, m, m, sequential);
+  real_t* theta = bml_allocate_memory(m * sizeof(real_t));
+  bml_diagonalize(g_bml, theta, s_bml);
+  real_t* s = bml_export_to_dense(s_bml, dense_row_major);
+
+  real_t homo = ZERO;
+  real_t lumo = ZERO;
+  int haveHomo = 0;
+  int haveLumo = 0;
+
+  if (bml_printRank())
+    printf("Spectrum slice from SP2 iteration %d (%d Lanczos steps):\n",
+      iter, nt);
+
+  int* order = malloc(m * sizeof(int));
+  for (int c = 0; c < m; c++)
+  {
+    int pos = c;
+    while (pos > 0 && theta[order[pos-1]] > theta[c])
+    {
+      order[pos] = order[pos-1];
+      pos--;
+    }
+    order[pos] = c;
+  }
+
+  for (int r = 0; r < m; r++)
+  {
+    int c = order[r];
+
+    // Residual ||H u - theta u|| and occupation u^T X u, u = V s_c
+    real_t res = ZERO;
+    for (int l = 0; l < N; l++)
+    {
+      real_t hu = ZERO;
+      real_t u = ZERO;
+      for (int a = 0; a < m; a++)
+      {
+        hu += s[a*m+c] * hv[(size_t) a * N + l];
+        u += s[a*m+c] * v[(size_t) a * N + l];
+      }
+      res += (hu - theta[c] * u) * (hu - theta[c] * u);
+    }
+    real_t occ = ZERO;
+    for (int a = 0; a < m; a++)
+      for (int b = 0; b < m; b++)
+        occ += s[a*m+c] * o[a*m+b] * s[b*m+c];
+
+    if (occ > HALF)
+    {
+      if (!haveHomo || theta[c] > homo) homo = theta[c];
+      haveHomo = 1;
+    }
+    else
+    {
+      if (!haveLumo || theta[c] < lumo) lumo = theta[c];
+      haveLumo = 1;
+    }
+
+    if (bml_printRank())
+      printf("  e = %lg  occupation = %lg  residual = %e\n", theta[c], occ,
+        sqrt(res));
+  }
+
+  if (bml_printRank())
+  {
+    if (haveHomo && haveLumo)
+      printf("HOMO = %lg  LUMO = %lg  gap = %lg\n", homo, lumo, lumo - homo);
+    else
+      printf("HOMO or LUMO not among the %d sliced states\n", m);
+  }
+
+  free(order);
+  bml_free_memory(s);
+  bml_free_memory(theta);
+  bml_deallocate(&g_bml);
+  bml_deallocate(&s_bml);
+  free(g);
+  free(o);
+  free(v);
+  free(hv);
+  free(xv);
+  csrDestroy(&h);
+}
@@ -0,0 +1,20 @@
+/// \file
+/// Interior eigenvalues from SP2 intermediates.
+
+#ifndef __SPECTRUMSLICE_H
+#define __SPECTRUMSLICE_H
+
+#include "bml.h"
+
+#include "mytype.h"
+#include "csrMatrix.h"
+
+/// Tr(X - X^2) per wanted state at which X is taken for slicing
+#define SLICE_FILL 0.25
+
+void spectrumSlice(const bml_matrix_t* h_bml,
+                   const CsrMatrix* x,
+                   const int nslice,
+                   const int iter);
+
+#endif
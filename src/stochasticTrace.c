@@ -0,0 +1,175 @@
+/// \file
+/// Stochastic estimate of the density of states.
+///
+/// The Chebyshev moments mu_k = Tr(T_k(Hs)) of the Hamiltonian, scaled
+/// to Hs with spectrum in [-1,1], are estimated Hutchinson style from
+/// random +-1 probe vectors v as the average of v^T T_k(Hs) v. Each
+/// probe costs nmoments/2 sparse matrix-vector products. The moments
+/// are damped with the Jackson kernel (kernel polynomial method) and
+/// turned into weights on Chebyshev-Gauss nodes, so that the trace of
+/// any function of H can be evaluated as a weighted sum of scalars.
+
+#include "bml.h"
+
+#include "stochasticTrace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "constants.h"
+#include "csrMatrix.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/// \details
+/// y = alpha*Hs*x + beta*z, with Hs = (H - center*I)/halfWidth.
+static void scaledMatVec(const CsrMatrix* h,
+                         const real_t center,
+                         const real_t halfWidth,
+                         const real_t alpha,
+                         const real_t* x,
+                         const real_t beta,
+                         const real_t* z,
+                         real_t* y)
+{
+  csrMatVec(h, x, y);
+
+  #pragma omp parallel for
+  for (int i = 0; i < h->N; i++)
+    y[i] = alpha * (y[i] - center * x[i]) / halfWidth + beta * z[i];
+}
+
+/// \details
+/// Fill v with random +-1 entries. The generator (xorshift64) is
+/// seeded by the probe number so results are reproducible.
+void randomProbe(const int n,
+                 const int probe,
+                 real_t* v)
+{
+  uint64_t state = 0x9E3779B97F4A7C15ULL * (uint64_t)(probe + 1);
+
+  for (int i = 0; i < n; i++)
+  {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    v[i] = (state >> 63) ? ONE : MINUS_ONE;
+  }
+}
+
+/// \details
+/// Jackson kernel factor g_k for moment k of an expansion truncated
+/// after nmoments terms. Damping the moments with g_k removes the Gibbs
+/// oscillations of the truncated series and keeps it non-negative
+/// where the expanded function is.
+real_t jacksonKernel(const int k,
+                     const int nmoments)
+{
+  real_t phase = M_PI / (nmoments + 1);
+
+  return ((nmoments - k + 1) * cos(phase * k) +
+    sin(phase * k) / tan(phase)) / (nmoments + 1);
+}
+
+/// \details
+/// Estimate the density of states of h_bml from nmoments Chebyshev
+/// moments and nprobes random vectors. The spectrum must lie inside
+/// [emin, emax], e.g. the Gershgorin bounds. The result has 2*nmoments
+/// nodes whose weights sum to N.
+SpectralDensity* stochasticDensity(const bml_matrix_t* h_bml,
+                                   const real_t emin,
+                                   const real_t emax,
+                                   const int nmoments,
+                                   const int nprobes,
+                                   const real_t threshold)
+{
+  int N = bml_get_N(h_bml);
+  int M = MAX(nmoments, 2);
+
+  // Keep the scaled spectrum strictly inside [-1,1]
+  real_t center = HALF * (emax + emin);
+  real_t halfWidth = 1.01 * HALF * (emax - emin);
+
+  CsrMatrix* h = csrFromBml(h_bml, threshold);
+
+  real_t* moment = calloc(M, sizeof(real_t));
+  real_t* v = malloc(N * sizeof(real_t));
+  real_t* tOld = malloc(N * sizeof(real_t));
+  real_t* t = malloc(N * sizeof(real_t));
+  real_t* tNew = malloc(N * sizeof(real_t));
+
+  for (int p = 0; p < nprobes; p++)
+  {
+    randomProbe(N, p, v);
+
+    // T_0 v = v, T_1 v = Hs v
+    for (int i = 0; i < N; i++) tOld[i] = v[i];
+    scaledMatVec(h, center, halfWidth, ONE, v, ZERO, v, t);
+    real_t mu0 = csrDot(N, v, v);
+    real_t mu1 = csrDot(N, v, t);
+    moment[0] += mu0;
+
+    // mu_2k = 2 <T_k v, T_k v> - mu_0
+    // mu_2k-1 = 2 <T_k v, T_k-1 v> - mu_1
+    for (int k = 1; 2 * k - 1 < M; k++)
+    {
+      moment[2*k-1] += TWO * csrDot(N, t, tOld) - mu1;
+      if (2 * k < M)
+        moment[2*k] += TWO * csrDot(N, t, t) - mu0;
+
+      // T_k+1 v = 2 Hs T_k v - T_k-1 v
+      scaledMatVec(h, center, halfWidth, TWO, t, MINUS_ONE, tOld, tNew);
+      real_t* swap = tOld;
+      tOld = t;
+      t = tNew;
+      tNew = swap;
+    }
+  }
+
+  for (int k = 0; k < M; k++)
+    moment[k] /= nprobes;
+
+  // Jackson kernel damping
+  for (int k = 0; k < M; k++)
+    moment[k] *= jacksonKernel(k, M);
+
+  // Weights on Chebyshev-Gauss nodes x_j = cos(theta_j)
+  SpectralDensity* dos = malloc(sizeof(SpectralDensity));
+  dos->nnodes = 2 * M;
+  dos->energy = malloc(dos->nnodes * sizeof(real_t));
+  dos->weight = malloc(dos->nnodes * sizeof(real_t));
+
+  for (int j = 0; j < dos->nnodes; j++)
+  {
+    real_t theta = M_PI * (j + HALF) / dos->nnodes;
+    real_t w = moment[0];
+    for (int k = 1; k < M; k++)
+      w += TWO * moment[k] * cos(k * theta);
+
+    dos->energy[j] = center + halfWidth * cos(theta);
+    dos->weight[j] = w / dos->nnodes;
+  }
+
+  free(moment);
+  free(v);
+  free(tOld);
+  free(t);
+  free(tNew);
+  csrDestroy(&h);
+
+  return dos;
+}
+
+/// \details
+/// Deallocate a density of states.
+void destroySpectralDensity(SpectralDensity** dos)
+{
+  free((*dos)->energy);
+  free((*dos)->weight);
+  free(*dos);
+  *dos = NULL;
+}
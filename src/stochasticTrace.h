@@ -0,0 +1,36 @@
+/// \file
+/// Stochastic estimate of the density of states.
+
+#ifndef __STOCHASTICTRACE_H
+#define __STOCHASTICTRACE_H
+
+#include "bml.h"
+
+#include "mytype.h"
+
+/// Density of states sampled on Chebyshev nodes, such that
+/// Tr(f(H)) ~ sum_j weight[j]*f(energy[j]).
+typedef struct SpectralDensitySt
+{
+  int nnodes;         //!< number of nodes
+  real_t* energy;     //!< energy of each node
+  real_t* weight;     //!< estimated number of states at each node
+} SpectralDensity;
+
+void randomProbe(const int n,
+                 const int probe,
+                 real_t* v);
+
+real_t jacksonKernel(const int k,
+                     const int nmoments);
+
+SpectralDensity* stochasticDensity(const bml_matrix_t* h_bml,
+                                   const real_t emin,
+                                   const real_t emax,
+                                   const int nmoments,
+                                   const int nprobes,
+                                   const real_t threshold);
+
+void destroySpectralDensity(SpectralDensity** dos);
+
+#endif